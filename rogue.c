@@ -1,34 +1,88 @@
-#include <stdio.h>
+#define _DEFAULT_SOURCE // For mmap(), madvise() and mkstemp() under -std=c11
+#include <stdio.h>    // For rename()
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h> // For INT_MAX
 #include <stdlib.h> // For rand(), srand(), malloc(), free()
+#include <string.h> // For strcmp()
 #include <time.h>   // For time()
-#include <math.h>   // For roundf()
+#include <inttypes.h> // For PRIu64
+#include <unistd.h>   // For ftruncate(), close(), unlink()
+#include <fcntl.h>    // For open()
+#include <sys/stat.h> // For fstat()
+#include <sys/mman.h> // For mmap(), madvise()
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include <SDL2/SDL_image.h>
 
 // --- Game Constants ---
 #define DUNGEON_FLOOR_COUNT 5
+#define MAX_RESIDENT_FLOORS 8 // Floors kept in memory; the rest are rebuilt from the seed when revisited
 
-// The dimensions of the tile grid
+// The default dimensions of the tile grid; --size picks others at run time
 #define GRID_COLS 80
 #define GRID_ROWS 50
+#define MIN_GRID_SIZE 16    // Fits the largest room and the wall around it
+#define MAX_GRID_SIZE 16384 // Light sources keep their coordinates in 16 bits
+
+// Floors are stored in square chunks, so the tiles around the player sit together in
+// memory and in chunk files whatever the size of the floor. A chunk row is one plane word.
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_TILES (CHUNK_SIZE * CHUNK_SIZE)
+#define CHUNK_RESIDENT_RADIUS 2             // Chunks either side of the player's kept in memory for file-backed floors
+#define CHUNK_FILE_MIN_TILES (2048 * 2048) // Floors this large get a chunk file even without --chunk-dir
+
+// The window shows at most this many tiles and follows the player over larger floors
+#define VIEW_COLS 80
+#define VIEW_ROWS 50
+#define VIEW_MARGIN 10 // Tiles kept between the player and the edge of the view
+#define VIEW_WORDS ((VIEW_COLS + 63) / 64)
 
 // The pixel dimensions of a single tile
 #define TILE_WIDTH 12
 #define TILE_HEIGHT 12
 
 // The calculated screen dimensions
-#define SCREEN_WIDTH (GRID_COLS * TILE_WIDTH)
-#define SCREEN_HEIGHT (GRID_ROWS * TILE_HEIGHT)
+#define SCREEN_WIDTH (VIEW_COLS * TILE_WIDTH)
+#define SCREEN_HEIGHT (VIEW_ROWS * TILE_HEIGHT)
 
 // Procedural Generation Parameters
-#define MAX_ROOMS 15
+#define MAX_ROOMS 15 // Room attempts per GRID_COLS x GRID_ROWS of floor
 #define MIN_ROOM_W 6
 #define MAX_ROOM_W 12
 #define MIN_ROOM_H 6
 #define MAX_ROOM_H 12
 
+// Main Loop Parameters
+#define FRAME_RATE 60 // Frames per second while pacing
+
+// Field of View Parameters
+#define PLAYER_SIGHT_RADIUS 20
+#define FOV_CACHE_ENTRIES 64
+#define MAX_LIGHT_RADIUS 127 // Largest radius with a precomputed extent table
+
+// Lighting Parameters
+#define MAX_FLOOR_LIGHTS 512
+#define MAX_LIGHT_SOURCE_RADIUS 10
+#define LIGHT_WINDOW (2 * MAX_LIGHT_SOURCE_RADIUS + 1)
+#define AMBIENT_LIGHT 128 // Brightness of visible tiles no light reaches, out of 255
+
+// Memory Parameters
+#define ARENA_BLOCK_SIZE (1 << 20) // Smallest block an arena asks the system for
+#define ARENA_ALIGNMENT 64         // Every arena allocation starts on a cache line
+
+// Save Parameters
+#define SAVE_PATH "rogue.sav" // Where saves go without --save or --load
+#define SAVE_MAGIC "ROGUESAV" // First 8 bytes of every save file
+#define SAVE_VERSION 1        // Bumped whenever the save layout changes
+#define SAVE_ALIGNMENT 16384  // Floor sections in a save start on a page, for 4K and 16K pages
+
+// Replay Parameters
+#define REPLAY_MAGIC "ROGUEREP" // First 8 bytes of every replay file
+#define REPLAY_VERSION 1        // Bumped whenever the replay layout changes
+#define REPLAY_MAX_RUN 16       // Most repeats of one command a replay byte holds
+
 // Cellular Automata Parameters
 #define CA_CHANCE_TO_START_ALIVE 45
 #define CA_SIMULATION_STEPS 5
@@ -41,29 +95,188 @@ typedef enum {
     TILE_GROUND,
     TILE_STAIRS_UP,
     TILE_STAIRS_DOWN,
-    TILE_WATER
+    TILE_WATER,
+    TILE_TYPE_COUNT
 } TileType;
 
+// PCG32 generator state; each floor has its own so it can be regenerated alone
 typedef struct {
-    TileType type;
-    bool is_visible;
-    bool is_explored; // Has this tile been seen at least once?
-} Tile;
+    uint64_t state;
+    uint64_t inc; // Stream selector, always odd
+} Rng;
 
 typedef struct {
-    Tile tiles[GRID_ROWS][GRID_COLS];
+    int16_t x, y;
+    uint8_t radius;
+    uint8_t r, g, b;
+} LightSource;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* previous;
+    size_t capacity; // Bytes after the header
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator over blocks from the system. Allocations are only given back all at once,
+// by resetting the arena to reuse its memory or freeing it.
+typedef struct {
+    ArenaBlock* block; // Newest block, NULL until the first allocation
+} Arena;
+
+typedef struct {
+    uint32_t revision; // Bumped whenever a tile in the chunk changes type
+} ChunkHeader;
+
+// Each per-tile property is its own contiguous array, so passes that only need
+// one of them (FOV, rendering the explored map) stream just that array. Every array
+// is stored a chunk at a time; see chunk_tile() and plane_word().
+//
+// The arrays share one block from floor_init(), either on the heap or mapped from a
+// chunk file. File-backed floors keep only the chunks near the player in memory (see
+// floor_page()) and can be unmapped whole when evicted, keeping the file. Floors loaded
+// by load_game() use their section of the save file instead, mapped copy-on-write.
+typedef struct Floor {
+    int width;
+    int height;
+    int stride;          // Chunks per row of chunks, which is also words per row of each bit plane
+    int chunk_count;
+    ChunkHeader* chunks;
+    uint8_t* types;      // TileType per tile
+    // Per-tile flags, one bit per tile, 64 columns to a word.
+    // Opaque and passable mirror the tile types; use set_tile_type() to keep them in step.
+    uint64_t* opaque;
+    uint64_t* passable;
+    uint64_t* visible;
+    uint64_t* explored; // Has this tile been seen at least once?
+    void* storage;        // The block holding every array above, NULL while unmapped
+    size_t storage_bytes;
+    bool is_file_backed;  // Mapped from the chunk file fd rather than allocated on the heap
+    bool owns_storage;    // Heap storage floor_init() allocated itself, freed by floor_free()
+    bool is_save_view;    // Storage is a section of the dungeon's save mapping
+    uint64_t* dirty_chunks; // Bit per chunk changed since the floor was last saved, NULL outside a dungeon
+    int fd;
+    SDL_Point page_chunk; // Chunk the resident chunks are centred on, x -1 for none
     SDL_Point stairs_up;
     SDL_Point stairs_down;
+    LightSource lights[MAX_FLOOR_LIGHTS];
+    int light_count;
+    uint32_t revision; // Bumped whenever a tile changes type
+    struct Floor* next_spare; // Next in the dungeon's list of floors free for reuse
 } Floor;
 
 typedef struct {
-    Floor* floors;
+    Floor* floor;       // NULL until generated, and again once evicted from the heap; file-backed floors are kept unmapped
+    uint64_t* explored; // What the player had seen when the floor was evicted, or NULL; in the dungeon's arena
+    bool is_pending;    // Being built, by the prefetch thread or a caller waiting on it
+    bool is_saved;      // In the last save as it is now, but for the floor's dirty chunks
+} FloorSlot;
+
+// Floors are generated on first use. A background thread builds the floors either side of
+// the player's so that taking the stairs does not wait on generation.
+typedef struct {
+    FloorSlot* slots;
+    int slot_count;     // Grows with the deepest floor asked for
     int floor_count;
+    int width, height;  // Size of every floor
+    const char* chunk_dir; // Where chunk files go, NULL for the heap unless floors are huge
+    int resident_count; // Floors mapped in memory
+    uint64_t seed;
+    SDL_mutex* lock;    // Guards everything below, and slots the prefetch thread may touch
+    Arena arena;        // Floors and the explored planes of evicted ones, released with the dungeon
+    Floor* spare_floors; // Evicted heap floors, ready to be built over
+    void* save_map;     // The save the dungeon was loaded from, mapped copy-on-write, or NULL
+    size_t save_bytes;
+    SDL_cond* work_ready;
+    SDL_cond* floor_ready;
+    SDL_Thread* prefetcher;
+    int requests[2];    // Floors queued for the prefetch thread, -1 for none
+    bool is_shutting_down;
 } Dungeon;
 
+// A save file is this header, a SaveFloor for each floor stored, then the floors' sections,
+// each starting on a SAVE_ALIGNMENT boundary. A section holds the arrays of a floor exactly as
+// floor_attach() lays them out on the heap, so a loaded floor points straight into the mapped
+// file. Integers are in the byte order of the machine that wrote it.
+typedef struct {
+    char magic[8];         // SAVE_MAGIC
+    uint64_t seed;
+    uint64_t file_bytes;   // Size of the whole file, so a truncated save is refused
+    uint32_t version;      // SAVE_VERSION
+    uint32_t header_bytes; // sizeof(SaveHeader) and sizeof(SaveFloor) when written, so builds
+    uint32_t floor_bytes;  // that lay the structs out differently refuse the file
+    int32_t floor_count;
+    int32_t width, height;
+    int32_t saved_floor_count; // SaveFloor entries following the header
+    int32_t current_floor_index;
+    int32_t player_x, player_y;
+    int32_t fov_mode;
+} SaveHeader;
+
+typedef enum {
+    SAVE_FLOOR_WHOLE,   // Every array of a floor in memory
+    SAVE_FLOOR_EXPLORED // The explored plane of an evicted floor; the rest comes from the seed
+} SaveFloorKind;
+
+typedef struct {
+    int32_t index;
+    uint32_t kind;   // SaveFloorKind
+    uint64_t offset; // Where the section starts in the file
+    uint64_t bytes;
+    int32_t stairs_up_x, stairs_up_y;
+    int32_t stairs_down_x, stairs_down_y;
+    uint32_t revision;
+    int32_t light_count;
+    LightSource lights[MAX_FLOOR_LIGHTS];
+} SaveFloor;
+
+// A floor as the save thread writes it. Chunks changed since the last save are copied into
+// the snapshot and the rest are written from the last save, so floors left alone cost nothing.
+typedef struct {
+    SaveFloor entry;
+    const uint8_t* shared;  // The floor's section in the last save, NULL if it is not there
+    const uint64_t* copied; // Bit per chunk copied; explored planes are copied or shared whole
+    const uint8_t* copy;    // The copied chunks in order, SNAPSHOT_CHUNK_BYTES each, or the explored plane
+} SnapshotFloor;
+
+// Writes saves on a thread of its own from snapshots taken between turns, so play carries on
+typedef struct {
+    SDL_Thread* thread;    // NULL until the first save
+    SDL_mutex* lock;       // Guards has_work and is_shutting_down
+    SDL_cond* work_ready;
+    SDL_cond* work_done;
+    bool has_work;         // A snapshot is waiting or being written; the thread owns everything below
+    bool is_shutting_down;
+    bool has_failed;       // The last snapshot was not saved
+    char path[4096];
+    SaveHeader header;
+    SnapshotFloor* floors; // header.saved_floor_count of them
+    Arena arena;           // The snapshot, reset for the next one
+    void* last_map;        // The last save written or loaded, mapped read-only, or NULL
+    size_t last_bytes;
+} Saver;
+
+// What the map texture currently shows, so a frame only redraws what changed
+typedef struct {
+    int floor_index;           // Floor drawn into the map texture, -1 to redraw everything
+    uint32_t revision;         // Floor revision drawn
+    uint32_t light_generation; // Light map generation drawn
+    bool is_text_mode;         // Drawn as glyphs rather than solid tiles
+    SDL_Point camera;          // Floor tile drawn in the top left corner
+    int width, height;         // Size of the floors drawn
+    int columns, rows;         // Tiles in view: the floor, up to VIEW_COLS x VIEW_ROWS
+    // The tiles in view as drawn, by row and column of the view
+    uint8_t types[VIEW_ROWS * VIEW_COLS];
+    uint64_t visible[VIEW_ROWS * VIEW_WORDS];
+    uint64_t explored[VIEW_ROWS * VIEW_WORDS];
+} MapView;
+
 typedef struct {
     SDL_Window* window;
     SDL_Renderer* renderer;
+    SDL_Texture* map_texture;   // Render target holding the shaded view
+    SDL_Texture* light_texture; // One texel per tile in view, multiplied over the map
+    SDL_Texture* glyph_atlas;   // CP437 glyphs in 16x16 tile-sized cells, NULL without a font
+    MapView map_view;
 } Graphics;
 
 typedef struct {
@@ -71,53 +284,533 @@ typedef struct {
     int y; // Row
 } Player;
 
+typedef enum {
+    FOV_SHADOWCAST, // Classic shadowcasting: permissive, but sight is not always mutual
+    FOV_SYMMETRIC   // Symmetric shadowcasting: A sees B exactly when B sees A
+} FovMode;
+
+// The bit planes the shadowcaster reads and writes, for a map of any size
+typedef struct {
+    int width;
+    int height;
+    int stride; // Words per row, laid out a chunk at a time like a floor's planes
+    const uint64_t* opaque;
+    uint64_t* visible;
+    uint64_t* explored;
+} FovMap;
+
+typedef struct {
+    int floor_index;  // Floor the area was lit on, -1 if none
+    int min_x, min_y; // Inclusive bounds of the lit tiles, empty when max_x < min_x
+    int max_x, max_y;
+} VisibleArea;
+
+// Rows and words per row a cached pass can cover: the widest lit area at
+// PLAYER_SIGHT_RADIUS, which may straddle one more word than it fills
+#define FOV_CACHE_ROWS (2 * PLAYER_SIGHT_RADIUS + 1)
+#define FOV_CACHE_WORDS ((2 * PLAYER_SIGHT_RADIUS + 63) / 64 + 1)
+
+// A finished FOV pass, reusable while its floor's revision is unchanged
+typedef struct {
+    VisibleArea area; // Floor and lit bounds
+    int x, y;
+    int radius;
+    FovMode mode;
+    uint32_t revision;
+    uint32_t last_used;
+    uint64_t visible[FOV_CACHE_ROWS * FOV_CACHE_WORDS]; // The words under area, from its top left word
+} FovCacheEntry;
+
+typedef struct {
+    FovCacheEntry* entries;
+    int entry_count; // 0 disables the cache
+    uint32_t clock;
+    long long hits;
+    long long misses;
+} FovCache;
+
+// What one light source adds to the tiles around it, as last cast
+typedef struct {
+    LightSource source;
+    bool is_cast;
+    uint8_t rgb[LIGHT_WINDOW * LIGHT_WINDOW][3]; // Window centred on the source
+} LightContribution;
+
+// The light map over one floor chunk, allocated once some light reaches into it
+typedef struct {
+    uint32_t revision;              // Floor chunk revision the walls were copied at
+    uint64_t opaque[CHUNK_SIZE];    // Walls the contributions were cast against
+    uint32_t light[CHUNK_TILES][3]; // Summed RGB values, laid out like a chunk of tile types
+} LightChunk;
+
+// Summed light for one floor. Each source's share is kept so a change only
+// recasts the sources it touches. Memory follows the lights, not the floor size.
+typedef struct {
+    int floor_index;                  // Floor the map was built for, -1 if none
+    uint32_t revision;                // Floor revision last checked
+    int width, height;                // Size of the floors it lights
+    int stride, chunk_count;          // Their chunk layout
+    LightChunk** chunks;              // One per floor chunk, NULL where no light reaches
+    int light_count;
+    uint32_t generation;              // Bumped whenever the summed light changes
+    LightContribution* contributions; // MAX_FLOOR_LIGHTS entries
+} LightMap;
+
+typedef void (*JobFunction)(void* data, int index);
+
+// Worker threads that run batches of independent jobs; the caller joins in too
+typedef struct {
+    SDL_Thread** threads;
+    int thread_count;
+    SDL_mutex* lock;
+    SDL_cond* work_ready;
+    SDL_cond* work_done;
+    JobFunction job;
+    void* job_data;
+    int job_count;
+    SDL_atomic_t next_job;
+    int generation;     // Bumped for every batch so workers can tell it is new
+    int active_workers; // Workers still inside the current batch
+    bool is_shutting_down;
+} ThreadPool;
+
+// Player actions, whether they come from the keyboard or a script
+typedef enum {
+    COMMAND_NONE,
+    COMMAND_MOVE_UP,
+    COMMAND_MOVE_DOWN,
+    COMMAND_MOVE_LEFT,
+    COMMAND_MOVE_RIGHT,
+    COMMAND_TOGGLE_SIGHT,
+    COMMAND_TOGGLE_TEXT,
+    COMMAND_SAVE,
+    COMMAND_QUIT
+} Command;
+
+// A replay file is this header, then the commands applied a run to a byte: the command in
+// the low four bits and the length of the run less one in the high four
+typedef struct {
+    char magic[8];         // REPLAY_MAGIC
+    uint64_t seed;
+    uint64_t trace;        // Trace of the recorded game, see record_command()
+    uint32_t version;      // REPLAY_VERSION
+    int32_t floor_count;
+    int32_t width, height;
+    int64_t command_count; // -1 until the recording is finished
+} ReplayHeader;
+
+// Commands as they are applied, and a trace of the game they drive so a replay can be
+// checked against the game it was recorded from
+typedef struct {
+    FILE* file;          // Replay being recorded, NULL when not recording
+    ReplayHeader header;
+    Command run_command; // Run of one command not yet written
+    int run_length;
+    int64_t command_count;
+    uint64_t trace;
+} Recorder;
+
+typedef enum {
+    LOOP_EVENT_DRIVEN, // Sleep until input arrives, draw only when something changed
+    LOOP_PACED         // Draw at a steady FRAME_RATE
+} LoopMode;
+
 typedef struct {
     bool is_running;
+    LoopMode loop_mode;
+    bool needs_redraw;      // State changed since the last frame
+    bool needs_full_redraw; // Render targets were lost and must be drawn from scratch
+    bool is_text_mode;      // Draw glyphs from the atlas instead of solid tiles
+    uint64_t seed; // Master seed every floor's generator is derived from
+    const char* load_path; // Save to resume from, NULL for a new game
+    const char* save_path; // Where saving writes, SAVE_PATH when NULL
+    int autosave_turns;    // Moves between autosaves, 0 for none
+    int turns_since_save;
+    Saver saver;
+    const char* record_path; // Where to record a replay, NULL for nowhere
+    Recorder recorder;
     int current_floor_index;
     Player player;
     Dungeon dungeon;
+    FovMode fov_mode;
+    VisibleArea visible_area;
+    FovCache fov_cache;
+    LightMap light_map;
 } GameState;
 
 
+// --- Tile Access Helpers ---
+
+// Chunk holding tile (x, y), with stride chunks per row of chunks in row-major order
+static inline int chunk_index(int stride, int x, int y) {
+    return (y >> CHUNK_SHIFT) * stride + (x >> CHUNK_SHIFT);
+}
+
+// Offset of tile (x, y) within its chunk; a chunk's tiles are in row-major order too
+static inline int chunk_offset(int x, int y) {
+    return ((y & (CHUNK_SIZE - 1)) << CHUNK_SHIFT) + (x & (CHUNK_SIZE - 1));
+}
+
+// Offset of tile (x, y) in a chunked array with CHUNK_TILES entries per chunk
+static inline size_t chunk_tile(int stride, int x, int y) {
+    return (size_t)chunk_index(stride, x, y) * CHUNK_TILES + chunk_offset(x, y);
+}
+
+static inline TileType get_tile_type(const Floor* floor, int x, int y) {
+    return (TileType)floor->types[chunk_tile(floor->stride, x, y)];
+}
+
+// Bit planes hold a chunk's rows in consecutive words, so word is also the chunk column
+static inline size_t plane_word(int stride, int word, int y) {
+    return ((size_t)(y >> CHUNK_SHIFT) * stride + word) * CHUNK_SIZE + (y & (CHUNK_SIZE - 1));
+}
+
+// Words in a bit plane for a map of width x height
+static inline size_t plane_words(int width, int height) {
+    return (size_t)((width + 63) / 64) * ((height + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+}
+
+// Bytes in one of a floor's bit planes
+static inline size_t plane_bytes(const Floor* floor) {
+    return sizeof(uint64_t) * floor->chunk_count * CHUNK_SIZE;
+}
+
+static inline bool plane_get(const uint64_t* plane, int stride, int x, int y) {
+    return (plane[plane_word(stride, x >> 6, y)] >> (x & 63)) & 1;
+}
+
+static inline void plane_set(uint64_t* plane, int stride, int x, int y, bool value) {
+    uint64_t bit = (uint64_t)1 << (x & 63);
+    if (value) {
+        plane[plane_word(stride, x >> 6, y)] |= bit;
+    } else {
+        plane[plane_word(stride, x >> 6, y)] &= ~bit;
+    }
+}
+
+// Notes that the chunks over tiles [min_x, max_x] x [min_y, max_y] changed since the floor
+// was last saved. Floors outside a dungeon are never saved and keep no bits.
+static inline void mark_chunks_dirty(Floor* floor, int min_x, int min_y, int max_x, int max_y) {
+    if (!floor->dirty_chunks) {
+        return;
+    }
+    for (int cy = min_y >> CHUNK_SHIFT; cy <= max_y >> CHUNK_SHIFT; cy++) {
+        for (int cx = min_x >> CHUNK_SHIFT; cx <= max_x >> CHUNK_SHIFT; cx++) {
+            int c = cy * floor->stride + cx;
+            floor->dirty_chunks[c >> 6] |= 1ULL << (c & 63);
+        }
+    }
+}
+
+// count bits (at most 64) of row y from column x, column x in bit 0. Columns past the
+// plane's last word read as clear.
+static inline uint64_t plane_run(const uint64_t* plane, int stride, int x, int y, int count) {
+    int word = x >> 6;
+    int shift = x & 63;
+    uint64_t run = plane[plane_word(stride, word, y)] >> shift;
+    if (shift > 0 && shift + count > 64 && word + 1 < stride) {
+        run |= plane[plane_word(stride, word + 1, y)] << (64 - shift);
+    }
+    return count < 64 ? run & ((1ULL << count) - 1) : run;
+}
+
+// Sets columns from_x to to_x (inclusive, from_x <= to_x) of row y, a word at a time
+static inline void plane_fill(uint64_t* plane, int stride, int from_x, int to_x, int y) {
+    for (int word = from_x >> 6; word <= to_x >> 6; word++) {
+        uint64_t mask = ~0ULL;
+        if (word == from_x >> 6) mask &= ~0ULL << (from_x & 63);
+        if (word == to_x >> 6) mask &= ~0ULL >> (63 - (to_x & 63));
+        plane[plane_word(stride, word, y)] |= mask;
+    }
+}
+
+// First column of row y from x towards end_x (step 1 or -1) whose bit equals value, read a
+// word at a time; end_x + step when there is none.
+static inline int plane_find(const uint64_t* plane, int stride, int x, int end_x, int step, int y, bool value) {
+    uint64_t flip = value ? 0 : ~0ULL;
+    if (step > 0) {
+        while (x <= end_x) {
+            uint64_t bits = (plane[plane_word(stride, x >> 6, y)] ^ flip) >> (x & 63);
+            if (bits) {
+                x += __builtin_ctzll(bits);
+                return x <= end_x ? x : end_x + 1;
+            }
+            x = (x | 63) + 1;
+        }
+        return end_x + 1;
+    }
+    while (x >= end_x) {
+        uint64_t bits = (plane[plane_word(stride, x >> 6, y)] ^ flip) << (63 - (x & 63));
+        if (bits) {
+            x -= __builtin_clzll(bits);
+            return x >= end_x ? x : end_x - 1;
+        }
+        x = (x & ~63) - 1;
+    }
+    return end_x - 1;
+}
+
+
 // --- Function Prototypes ---
 
 // Game Loop Functions
 bool init_systems(Graphics* graphics, GameState* game_state);
+bool init_game(GameState* game_state);
 void cleanup(Graphics* graphics, GameState* game_state);
-void handle_input(GameState* game_state);
-void update_game(GameState* game_state);
-void render(const Graphics* graphics, const GameState* game_state);
+void cleanup_game(GameState* game_state);
+int run_headless(GameState* game_state, const char* script_path, long turn_limit);
+bool play_replay(Graphics* graphics, GameState* game_state, const Command* commands, long command_count, const ReplayHeader* header);
+void handle_input(GameState* game_state, int timeout);
+void handle_event(GameState* game_state, const SDL_Event* event);
+void wait_for_frame(GameState* game_state, Uint64 deadline);
+Command key_command(SDL_Keycode key);
+Command script_command(char c);
+void apply_command(GameState* game_state, Command command);
+Floor* player_floor(GameState* game_state);
+Floor* update_game(GameState* game_state);
+void render(Graphics* graphics, const GameState* game_state, const Floor* current_floor);
+void map_view_init(MapView* view, int width, int height);
+SDL_Point follow_player(SDL_Point camera, const MapView* view, const Player* player);
+bool find_map_changes(MapView* view, const Floor* floor, const GameState* game_state, SDL_Point camera, SDL_Rect* area);
+int draw_map(SDL_Renderer* renderer, const Floor* floor, const SDL_Rect* area, SDL_Point camera);
+
+// Glyphs
+SDL_Texture* build_glyph_atlas(SDL_Renderer* renderer, const char* font_path);
+void draw_glyph(SDL_Renderer* renderer, SDL_Texture* atlas, int x, int y, int code, SDL_Color color);
+int draw_map_glyphs(SDL_Renderer* renderer, SDL_Texture* atlas, const Floor* floor, const SDL_Rect* area, SDL_Point camera);
+
+// Random Numbers
+void rng_seed(Rng* rng, uint64_t seed, uint64_t stream);
+uint32_t rng_next(Rng* rng);
+int rng_range(Rng* rng, int bound);
+Rng floor_rng(uint64_t master_seed, int floor_index);
+
+// Arenas
+void* arena_alloc(Arena* arena, size_t bytes);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+Arena* scratch_arena(void);
+void release_scratch_arena(void);
+
+// Dungeon
+size_t floor_storage_bytes(int width, int height);
+bool floor_init(Floor* floor, int width, int height, int fd, void* storage);
+void floor_free(Floor* floor);
+bool floor_map(Floor* floor);
+void floor_unmap(Floor* floor);
+void floor_page(Floor* floor, int x, int y);
+bool dungeon_init(Dungeon* dungeon, int floor_count, int width, int height, uint64_t seed);
+void dungeon_free(Dungeon* dungeon);
+Floor* dungeon_floor(Dungeon* dungeon, int index);
+void dungeon_prefetch(Dungeon* dungeon, int current_index);
+
+// Saves
+bool save_game(GameState* game_state, const char* path);
+bool finish_save(Saver* saver);
+void autosave(GameState* game_state);
+void saver_free(Saver* saver);
+bool load_game(GameState* game_state, const char* path);
+
+// Replays
+bool start_recording(GameState* game_state, const char* path);
+void record_command(GameState* game_state, Command command);
+bool finish_recording(GameState* game_state);
+uint64_t replay_trace(const GameState* game_state);
+Command* read_replay(FILE* file, const char* path, GameState* game_state, ReplayHeader* header, long* command_count);
+bool check_replay(const GameState* game_state, const ReplayHeader* header);
 
 // Dungeon Generation
-void generate_floor(Floor* floor);
+void generate_dungeon(ThreadPool* pool, Floor* floors, int floor_count, uint64_t seed);
+bool generate_floor(Floor* floor, Rng* rng);
 void carve_room(Floor* floor, SDL_Rect room);
 void carve_h_corridor(Floor* floor, int x1, int x2, int y);
 void carve_v_corridor(Floor* floor, int y1, int y2, int x);
-void generate_lakes(Floor* floor);
+bool generate_lakes(Floor* floor, Rng* rng);
+void ca_step(const uint64_t* old_map, uint64_t* new_map, int width, int height);
+void set_tile_type(Floor* floor, int x, int y, TileType type);
 
 // Field of View
-void update_fov(GameState* game_state);
-void cast_light(GameState* game_state, int octant, int row, float start_slope, float end_slope);
+void init_light_tables(void);
+void update_fov(GameState* game_state, int radius);
+FovMap floor_fov_map(Floor* floor);
+int compute_fov(const FovMap* map, int origin_x, int origin_y, int radius, FovMode mode, VisibleArea* area);
+int cast_light(const FovMap* map, int origin_x, int origin_y, int radius, int octant, VisibleArea* area);
+int cast_symmetric(const FovMap* map, int origin_x, int origin_y, int radius, int octant, VisibleArea* area);
+bool can_see_player(GameState* game_state, int x, int y);
+void clear_visible_area(const FovMap* map, VisibleArea* area);
+bool fov_cache_init(FovCache* cache, int entry_count);
+void fov_cache_free(FovCache* cache);
+FovCacheEntry* fov_cache_lookup(FovCache* cache, int floor_index, int x, int y, int radius, FovMode mode, uint32_t revision, bool* hit);
+void release_fov_stack(void);
+size_t fov_plane_words(const FovMap* map);
+bool compute_fov_batch(ThreadPool* pool, const FovMap* map, const SDL_Point* observers, int observer_count, int radius, FovMode mode, uint64_t* visibility);
+
+// Lighting
+bool add_light(Floor* floor, int x, int y, int radius, Uint8 r, Uint8 g, Uint8 b);
+void remove_lights_at(Floor* floor, int x, int y);
+bool light_map_init(LightMap* light_map, int width, int height);
+void light_map_free(LightMap* light_map);
+const uint32_t* light_at(const LightMap* light_map, int x, int y);
+int update_light_map(LightMap* light_map, const Floor* floor, int floor_index);
+
+// Thread Pool
+bool thread_pool_init(ThreadPool* pool, int thread_count);
+void thread_pool_run(ThreadPool* pool, JobFunction job, void* data, int count);
+void thread_pool_shutdown(ThreadPool* pool);
+
+// Benchmarks
+void run_fov_benchmark(void);
+void run_light_benchmark(void);
+void run_generation_benchmark(void);
+void run_save_benchmark(void);
+void run_render_benchmark(const char* font_path);
 
 
 // --- Main Function ---
 
-int main(void) {
-    srand(time(NULL)); // Seed the random number generator
+int main(int argc, char* argv[]) {
+    init_light_tables();
+
+    if (argc > 1 && strcmp(argv[1], "--bench-fov") == 0) {
+        run_fov_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-light") == 0) {
+        run_light_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-gen") == 0) {
+        run_generation_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-save") == 0) {
+        run_save_benchmark();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-render") == 0) {
+        run_render_benchmark(argc > 2 ? argv[2] : NULL);
+        return 0;
+    }
 
     Graphics graphics = {0};
-    GameState game_state = { .is_running = true };
+    GameState game_state = { .is_running = true, .needs_redraw = true, .seed = (uint64_t)time(NULL) };
+    const char* font_path = NULL;
+    const char* script_path = NULL;
+    const char* replay_path = NULL;
+    long turn_limit = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--paced") == 0) {
+            game_state.loop_mode = LOOP_PACED;
+        } else if (strcmp(argv[i], "--font") == 0 && i + 1 < argc) {
+            font_path = argv[++i];
+        } else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+        } else if (strcmp(argv[i], "--turns") == 0 && i + 1 < argc) {
+            turn_limit = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            game_state.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--floors") == 0 && i + 1 < argc) {
+            game_state.dungeon.floor_count = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            int width, height;
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width < MIN_GRID_SIZE || height < MIN_GRID_SIZE ||
+                width > MAX_GRID_SIZE || height > MAX_GRID_SIZE) {
+                fprintf(stderr, "Map size must be WIDTHxHEIGHT, each from %d to %d.\n", MIN_GRID_SIZE, MAX_GRID_SIZE);
+                return 1;
+            }
+            game_state.dungeon.width = width;
+            game_state.dungeon.height = height;
+        } else if (strcmp(argv[i], "--chunk-dir") == 0 && i + 1 < argc) {
+            game_state.dungeon.chunk_dir = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            game_state.load_path = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            game_state.save_path = argv[++i];
+        } else if (strcmp(argv[i], "--autosave") == 0 && i + 1 < argc) {
+            game_state.autosave_turns = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            game_state.record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!game_state.save_path) {
+        game_state.save_path = game_state.load_path; // A resumed game saves over its save
+    }
+
+    if (script_path) {
+        return run_headless(&game_state, script_path, turn_limit);
+    }
+
+    // A replay sets the seed and dungeon size, so it is read before the game is built
+    Command* replay = NULL;
+    long replay_count = 0;
+    ReplayHeader replay_header;
+    if (replay_path) {
+        FILE* file = fopen(replay_path, "rb");
+        if (!file) {
+            fprintf(stderr, "Could not open replay %s.\n", replay_path);
+            return 1;
+        }
+        replay = read_replay(file, replay_path, &game_state, &replay_header, &replay_count);
+        fclose(file);
+        if (!replay) {
+            return 1;
+        }
+    }
 
     if (!init_systems(&graphics, &game_state)) {
+        free(replay);
         return 1;
     }
+    if (font_path) {
+        graphics.glyph_atlas = build_glyph_atlas(graphics.renderer, font_path);
+        if (!graphics.glyph_atlas) {
+            cleanup(&graphics, &game_state);
+            free(replay);
+            return 1;
+        }
+        game_state.is_text_mode = true;
+    }
+
+    if (replay) {
+        bool is_same = play_replay(&graphics, &game_state, replay, replay_count, &replay_header);
+        cleanup(&graphics, &game_state);
+        free(replay);
+        return is_same ? 0 : 1;
+    }
 
     // Main game loop
+    Uint64 frame_period = SDL_GetPerformanceFrequency() / FRAME_RATE;
+    Uint64 next_frame = SDL_GetPerformanceCounter();
     while (game_state.is_running) {
-        handle_input(&game_state);
-        update_game(&game_state);
-        render(&graphics, &game_state);
-        SDL_Delay(16); // Cap framerate roughly
+        bool is_paced = game_state.loop_mode == LOOP_PACED;
+        if (is_paced) {
+            wait_for_frame(&game_state, next_frame);
+            // Deadlines advance by whole periods so timing does not drift; after a stall, start over
+            Uint64 now = SDL_GetPerformanceCounter();
+            next_frame += frame_period;
+            if (next_frame < now) {
+                next_frame = now + frame_period;
+            }
+        } else {
+            handle_input(&game_state, -1); // Sleep until something happens
+            next_frame = SDL_GetPerformanceCounter();
+        }
+
+        const Floor* current_floor = update_game(&game_state);
+        if (game_state.needs_full_redraw) {
+            graphics.map_view.floor_index = -1;
+            game_state.needs_full_redraw = false;
+        }
+        if (current_floor && (game_state.needs_redraw || is_paced)) {
+            render(&graphics, &game_state, current_floor);
+            game_state.needs_redraw = false;
+        }
     }
 
     cleanup(&graphics, &game_state);
@@ -133,7 +826,17 @@ bool init_systems(Graphics* graphics, GameState* game_state) {
         return false;
     }
 
-    graphics->window = SDL_CreateWindow("C Roguelike", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+    if (!init_game(game_state)) {
+        return false;
+    }
+    // The window fits the floor, or a view of it when the floor is larger
+    map_view_init(&graphics->map_view, game_state->dungeon.width, game_state->dungeon.height);
+    int columns = graphics->map_view.columns;
+    int rows = graphics->map_view.rows;
+
+    char title[64];
+    snprintf(title, sizeof(title), "C Roguelike (seed %" PRIu64 ")", game_state->seed);
+    graphics->window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, columns * TILE_WIDTH, rows * TILE_HEIGHT, SDL_WINDOW_SHOWN);
     if (!graphics->window) {
         fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
         return false;
@@ -145,39 +848,78 @@ bool init_systems(Graphics* graphics, GameState* game_state) {
         return false;
     }
 
-    // Initialize Dungeon
-    game_state->dungeon.floor_count = DUNGEON_FLOOR_COUNT;
-    game_state->dungeon.floors = malloc(sizeof(Floor) * game_state->dungeon.floor_count);
-    if (!game_state->dungeon.floors) {
-        fprintf(stderr, "Failed to allocate memory for dungeon floors.\n");
+    graphics->light_texture = SDL_CreateTexture(graphics->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, columns, rows);
+    if (!graphics->light_texture) {
+        fprintf(stderr, "Could not create light texture: %s\n", SDL_GetError());
         return false;
     }
+    SDL_SetTextureBlendMode(graphics->light_texture, SDL_BLENDMODE_MOD);
 
-    for (int i = 0; i < game_state->dungeon.floor_count; ++i) {
-        generate_floor(&game_state->dungeon.floors[i]);
+    graphics->map_texture = SDL_CreateTexture(graphics->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, columns * TILE_WIDTH, rows * TILE_HEIGHT);
+    if (!graphics->map_texture) {
+        fprintf(stderr, "Could not create map texture: %s\n", SDL_GetError());
+        return false;
     }
-    
-    // Adjust stairs for top and bottom floors
-    game_state->dungeon.floors[0].tiles[game_state->dungeon.floors[0].stairs_up.y][game_state->dungeon.floors[0].stairs_up.x].type = TILE_GROUND;
-    int last_floor = game_state->dungeon.floor_count - 1;
-    game_state->dungeon.floors[last_floor].tiles[game_state->dungeon.floors[last_floor].stairs_down.y][game_state->dungeon.floors[last_floor].stairs_down.x].type = TILE_GROUND;
+    return true;
+}
 
+// Builds the dungeon, or loads it from game_state->load_path, and everything the game
+// needs short of a window. A loaded game keeps the seed and sizes it was saved with.
+bool init_game(GameState* game_state) {
+    if (game_state->load_path) {
+        if (!load_game(game_state, game_state->load_path)) {
+            return false;
+        }
+    } else {
+        // Initialize Dungeon: only the first floor is built now, the rest as the player nears them
+        int floor_count = game_state->dungeon.floor_count > 0 ? game_state->dungeon.floor_count : DUNGEON_FLOOR_COUNT;
+        int width = game_state->dungeon.width > 0 ? game_state->dungeon.width : GRID_COLS;
+        int height = game_state->dungeon.height > 0 ? game_state->dungeon.height : GRID_ROWS;
+        const char* chunk_dir = game_state->dungeon.chunk_dir;
+        if (!dungeon_init(&game_state->dungeon, floor_count, width, height, game_state->seed)) {
+            return false;
+        }
+        game_state->dungeon.chunk_dir = chunk_dir; // No floor has been built yet
+        Floor* first_floor = dungeon_floor(&game_state->dungeon, 0);
+        if (!first_floor) {
+            return false;
+        }
+
+        // Set initial game state
+        game_state->current_floor_index = 0;
+        game_state->player.x = first_floor->stairs_up.x;
+        game_state->player.y = first_floor->stairs_up.y;
+    }
+    if (!dungeon_floor(&game_state->dungeon, game_state->current_floor_index)) {
+        return false;
+    }
+    dungeon_prefetch(&game_state->dungeon, game_state->current_floor_index);
+
+    // Nothing has been lit yet
+    game_state->visible_area = (VisibleArea){ -1, INT_MAX, INT_MAX, -1, -1 };
+    if (!fov_cache_init(&game_state->fov_cache, FOV_CACHE_ENTRIES)) {
+        fprintf(stderr, "Failed to allocate memory for the FOV cache.\n");
+        return false;
+    }
+    if (!light_map_init(&game_state->light_map, game_state->dungeon.width, game_state->dungeon.height)) {
+        fprintf(stderr, "Failed to allocate memory for the light map.\n");
+        return false;
+    }
 
-    // Set initial game state
-    game_state->current_floor_index = 0;
-    game_state->player.x = game_state->dungeon.floors[0].stairs_up.x;
-    game_state->player.y = game_state->dungeon.floors[0].stairs_up.y;
-    
     // Initial FOV calculation
-    update_fov(game_state);
+    update_fov(game_state, PLAYER_SIGHT_RADIUS);
 
+    if (game_state->record_path && !start_recording(game_state, game_state->record_path)) {
+        return false;
+    }
     return true;
 }
 
 void cleanup(Graphics* graphics, GameState* game_state) {
-    if (game_state->dungeon.floors) {
-        free(game_state->dungeon.floors);
-    }
+    cleanup_game(game_state);
+    if (graphics->light_texture) SDL_DestroyTexture(graphics->light_texture);
+    if (graphics->map_texture) SDL_DestroyTexture(graphics->map_texture);
+    if (graphics->glyph_atlas) SDL_DestroyTexture(graphics->glyph_atlas);
     if (graphics->renderer) SDL_DestroyRenderer(graphics->renderer);
     if (graphics->window) SDL_DestroyWindow(graphics->window);
     IMG_Quit();
@@ -185,330 +927,4002 @@ void cleanup(Graphics* graphics, GameState* game_state) {
     SDL_Quit();
 }
 
+void cleanup_game(GameState* game_state) {
+    finish_recording(game_state);
+    saver_free(&game_state->saver); // Finishes the save being written first
+    dungeon_free(&game_state->dungeon);
+    fov_cache_free(&game_state->fov_cache);
+    light_map_free(&game_state->light_map);
+}
 
-// --- Core Game Loop Functions ---
-
-void handle_input(GameState* game_state) {
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-        if (event.type == SDL_QUIT) {
-            game_state->is_running = false;
-        } else if (event.type == SDL_KEYDOWN) {
-            int next_x = game_state->player.x;
-            int next_y = game_state->player.y;
-            bool key_pressed = false;
-
-            switch (event.key.keysym.sym) {
-                case SDLK_ESCAPE: game_state->is_running = false; break;
-                case SDLK_UP: case SDLK_k: next_y--; key_pressed = true; break;
-                case SDLK_DOWN: case SDLK_j: next_y++; key_pressed = true; break;
-                case SDLK_LEFT: case SDLK_h: next_x--; key_pressed = true; break;
-                case SDLK_RIGHT: case SDLK_l: next_x++; key_pressed = true; break;
-            }
-
-            if (key_pressed) {
-                if (next_x < 0 || next_x >= GRID_COLS || next_y < 0 || next_y >= GRID_ROWS) {
-                    continue;
-                }
-
-                Floor* current_floor = &game_state->dungeon.floors[game_state->current_floor_index];
-                TileType next_tile_type = current_floor->tiles[next_y][next_x].type;
-                bool moved = false;
-
-                switch (next_tile_type) {
-                    case TILE_WALL:
-                        // Water is now traversable, so it's removed from this case.
-                        break; // Cannot move
-                    
-                    case TILE_STAIRS_DOWN:
-                        if (game_state->current_floor_index < game_state->dungeon.floor_count - 1) {
-                            game_state->current_floor_index++;
-                            Floor* new_floor = &game_state->dungeon.floors[game_state->current_floor_index];
-                            game_state->player.x = new_floor->stairs_up.x;
-                            game_state->player.y = new_floor->stairs_up.y;
-                            moved = true;
-                        }
-                        break;
-
-                    case TILE_STAIRS_UP:
-                        if (game_state->current_floor_index > 0) {
-                            game_state->current_floor_index--;
-                            Floor* new_floor = &game_state->dungeon.floors[game_state->current_floor_index];
-                            game_state->player.x = new_floor->stairs_down.x;
-                            game_state->player.y = new_floor->stairs_down.y;
-                            moved = true;
-                        }
-                        break;
-                    
-                    default: // Includes TILE_GROUND and TILE_WATER
-                        game_state->player.x = next_x;
-                        game_state->player.y = next_y;
-                        moved = true;
-                        break;
-                }
-                if (moved) {
-                    update_fov(game_state);
-                }
+// Adds command repeat times to a growing list of commands
+static bool push_commands(Command** commands, long* command_count, long* capacity, Command command, long repeat) {
+    for (; repeat > 0; repeat--) {
+        if (*command_count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 256;
+            Command* grown = realloc(*commands, *capacity * sizeof(Command));
+            if (!grown) {
+                fprintf(stderr, "Failed to allocate memory for the commands.\n");
+                return false;
             }
+            *commands = grown;
         }
+        (*commands)[(*command_count)++] = command;
     }
+    return true;
 }
 
-void update_game(GameState* game_state) {
-    (void)game_state;
-}
-
-void render(const Graphics* graphics, const GameState* game_state) {
-    SDL_SetRenderDrawColor(graphics->renderer, 0, 0, 0, 255);
-    SDL_RenderClear(graphics->renderer);
-
-    const Floor* current_floor = &game_state->dungeon.floors[game_state->current_floor_index];
-
-    // Draw the map
-    for (int y = 0; y < GRID_ROWS; ++y) {
-        for (int x = 0; x < GRID_COLS; ++x) {
-            SDL_Rect tile_rect = { x * TILE_WIDTH, y * TILE_HEIGHT, TILE_WIDTH, TILE_HEIGHT };
-            const Tile* tile = &current_floor->tiles[y][x];
-
-            if (tile->is_visible) {
-                switch (tile->type) {
-                    case TILE_WALL:        SDL_SetRenderDrawColor(graphics->renderer, 80, 80, 80, 255); break;
-                    case TILE_GROUND:      SDL_SetRenderDrawColor(graphics->renderer, 180, 180, 180, 255); break;
-                    case TILE_STAIRS_DOWN: SDL_SetRenderDrawColor(graphics->renderer, 60, 120, 220, 255); break;
-                    case TILE_STAIRS_UP:   SDL_SetRenderDrawColor(graphics->renderer, 220, 120, 60, 255); break;
-                    case TILE_WATER:       SDL_SetRenderDrawColor(graphics->renderer, 50, 80, 200, 255); break;
-                }
-                SDL_RenderFillRect(graphics->renderer, &tile_rect);
-            } else if (tile->is_explored) {
-                switch (tile->type) {
-                    case TILE_WALL:        SDL_SetRenderDrawColor(graphics->renderer, 20, 20, 20, 255); break;
-                    case TILE_GROUND:      SDL_SetRenderDrawColor(graphics->renderer, 60, 60, 60, 255); break;
-                    case TILE_STAIRS_DOWN: SDL_SetRenderDrawColor(graphics->renderer, 20, 40, 80, 255); break;
-                    case TILE_STAIRS_UP:   SDL_SetRenderDrawColor(graphics->renderer, 80, 40, 20, 255); break;
-                    case TILE_WATER:       SDL_SetRenderDrawColor(graphics->renderer, 15, 25, 70, 255); break;
-                }
-                 SDL_RenderFillRect(graphics->renderer, &tile_rect);
+// Expands the script in file into a flat list of commands, so the turn loop only replays it
+static Command* read_script(FILE* file, const char* path, long* command_count) {
+    Command* commands = NULL;
+    long count = 0, capacity = 0;
+    long repeat = 0;
+    bool is_valid = true;
+    int c;
+    while ((c = fgetc(file)) != EOF && is_valid) {
+        if (c == '#') {
+            while ((c = fgetc(file)) != EOF && c != '\n') {}
+        } else if (c >= '0' && c <= '9') {
+            repeat = repeat * 10 + (c - '0');
+        } else if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+            Command command = script_command((char)c);
+            if (command == COMMAND_NONE) {
+                fprintf(stderr, "Unknown command '%c' in %s.\n", c, path);
+                is_valid = false;
+                break;
             }
+            is_valid = push_commands(&commands, &count, &capacity, command, repeat > 0 ? repeat : 1);
+            repeat = 0;
         }
     }
-
-    if (current_floor->tiles[game_state->player.y][game_state->player.x].is_visible) {
-        SDL_Rect player_rect = { game_state->player.x * TILE_WIDTH, game_state->player.y * TILE_HEIGHT, TILE_WIDTH, TILE_HEIGHT };
-        SDL_SetRenderDrawColor(graphics->renderer, 255, 255, 0, 255);
-        SDL_RenderFillRect(graphics->renderer, &player_rect);
+    if (!is_valid || count == 0) {
+        if (is_valid) fprintf(stderr, "Script %s has no commands.\n", path);
+        free(commands);
+        return NULL;
     }
-
-    SDL_RenderPresent(graphics->renderer);
+    *command_count = count;
+    return commands;
 }
 
-
-// --- Dungeon Generation Functions ---
-
-void generate_floor(Floor* floor) {
-    for (int y = 0; y < GRID_ROWS; ++y) {
-        for (int x = 0; x < GRID_COLS; ++x) {
-            floor->tiles[y][x].type = TILE_WALL;
-            floor->tiles[y][x].is_visible = false;
-            floor->tiles[y][x].is_explored = false;
-        }
+// Plays the commands in a script or replay file with no window or renderer and reports
+// turns per second. A script repeats until turn_limit turns have been taken (0 plays it
+// once); a replay plays once, in the game it was recorded in, and is checked against it.
+// Scripts are the move keys h, j, k, l, v to switch sight, s to save and q to stop, each
+// optionally preceded by a repeat count; whitespace is ignored and # starts a comment.
+// game_state holds the options the game is set up with: seed, dungeon size and save paths.
+int run_headless(GameState* game_state, const char* script_path, long turn_limit) {
+    FILE* file = fopen(script_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open script %s.\n", script_path);
+        return 1;
     }
 
-    SDL_Rect rooms[MAX_ROOMS];
-    int room_count = 0;
-
-    for (int i = 0; i < MAX_ROOMS; ++i) {
-        int w = MIN_ROOM_W + rand() % (MAX_ROOM_W - MIN_ROOM_W + 1);
-        int h = MIN_ROOM_H + rand() % (MAX_ROOM_H - MIN_ROOM_H + 1);
-        int x = rand() % (GRID_COLS - w - 1) + 1;
-        int y = rand() % (GRID_ROWS - h - 1) + 1;
+    // Replays are told from scripts by their magic
+    char magic[8];
+    bool is_replay = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, REPLAY_MAGIC, sizeof(magic)) == 0;
+    rewind(file);
+    ReplayHeader replay;
+    long command_count = 0;
+    Command* commands = is_replay ? read_replay(file, script_path, game_state, &replay, &command_count)
+                                  : read_script(file, script_path, &command_count);
+    fclose(file);
+    if (!commands) {
+        return 1;
+    }
 
-        SDL_Rect new_room = {x, y, w, h};
-        bool failed = false;
-        for (int j = 0; j < room_count; ++j) {
-            if (SDL_HasIntersection(&new_room, &rooms[j])) {
-                failed = true;
-                break;
-            }
-        }
+    if (!init_game(game_state)) {
+        cleanup_game(game_state);
+        free(commands);
+        return 1;
+    }
 
-        if (!failed) {
-            carve_room(floor, new_room);
-            if (room_count > 0) {
-                SDL_Point new_center = {x + w / 2, y + h / 2};
-                SDL_Point prev_center = {rooms[room_count - 1].x + rooms[room_count - 1].w / 2, rooms[room_count - 1].y + rooms[room_count - 1].h / 2};
-                if (rand() % 2 == 0) {
-                    carve_h_corridor(floor, prev_center.x, new_center.x, prev_center.y);
-                    carve_v_corridor(floor, prev_center.y, new_center.y, new_center.x);
-                } else {
-                    carve_v_corridor(floor, prev_center.y, new_center.y, prev_center.x);
-                    carve_h_corridor(floor, prev_center.x, new_center.x, new_center.y);
-                }
-            }
-            rooms[room_count++] = new_room;
-        }
+    long turns = 0;
+    long goal = turn_limit > 0 && !is_replay ? turn_limit : command_count;
+    Uint64 start = SDL_GetPerformanceCounter();
+    while (game_state->is_running && turns < goal) {
+        apply_command(game_state, commands[turns % command_count]);
+        update_game(game_state);
+        turns++;
     }
-    
-    // Generate and apply lakes before placing stairs
-    generate_lakes(floor);
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-    floor->stairs_up = (SDL_Point){rooms[0].x + rooms[0].w / 2, rooms[0].y + rooms[0].h / 2};
-    floor->tiles[floor->stairs_up.y][floor->stairs_up.x].type = TILE_STAIRS_UP;
-    
-    floor->stairs_down = (SDL_Point){rooms[room_count - 1].x + rooms[room_count - 1].w / 2, rooms[room_count - 1].y + rooms[room_count - 1].h / 2};
-    floor->tiles[floor->stairs_down.y][floor->stairs_down.x].type = TILE_STAIRS_DOWN;
+    printf("%ld turns in %.3f s, %.0f turns/s\n", turns, seconds, turns / seconds);
+    printf("Seed %" PRIu64 " ended on floor %d at (%d, %d)\n", game_state->seed, game_state->current_floor_index + 1, game_state->player.x, game_state->player.y);
+    bool is_same = !is_replay || check_replay(game_state, &replay);
+
+    cleanup_game(game_state);
+    free(commands);
+    return is_same ? 0 : 1;
 }
 
-int ca_count_alive_neighbors(bool map[GRID_ROWS][GRID_COLS], int x, int y) {
-    int count = 0;
-    for (int i = -1; i < 2; i++) {
-        for (int j = -1; j < 2; j++) {
-            if (i == 0 && j == 0) continue;
 
-            int nx = x + i;
-            int ny = y + j;
+// --- Core Game Loop Functions ---
 
-            if (nx < 0 || nx >= GRID_COLS || ny < 0 || ny >= GRID_ROWS) {
-                count++; // Count out-of-bounds as "alive" to keep edges solid
-            } else if (map[ny][nx]) {
-                count++;
-            }
-        }
+// Handles the events waiting in the queue. With nothing queued it waits up to timeout
+// milliseconds for one first: 0 returns at once, and a negative timeout waits indefinitely.
+void handle_input(GameState* game_state, int timeout) {
+    SDL_Event event;
+    int has_event;
+    if (timeout < 0) {
+        has_event = SDL_WaitEvent(&event);
+    } else if (timeout > 0) {
+        has_event = SDL_WaitEventTimeout(&event, timeout);
+    } else {
+        has_event = SDL_PollEvent(&event);
+    }
+
+    while (has_event) {
+        handle_event(game_state, &event);
+        has_event = SDL_PollEvent(&event);
     }
-    return count;
 }
 
-void ca_do_simulation_step(bool old_map[GRID_ROWS][GRID_COLS], bool new_map[GRID_ROWS][GRID_COLS]) {
-    for (int y = 0; y < GRID_ROWS; y++) {
-        for (int x = 0; x < GRID_COLS; x++) {
-            int nbs = ca_count_alive_neighbors(old_map, x, y);
-            if (old_map[y][x]) {
-                new_map[y][x] = nbs >= 4;
-            } else {
-                new_map[y][x] = nbs >= 5;
-            }
+// Handles input until the performance counter reaches deadline. Sleeps in the event queue
+// for all but the last millisecond, which is polled so the frame starts on time.
+void wait_for_frame(GameState* game_state, Uint64 deadline) {
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    for (;;) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline) {
+            handle_input(game_state, 0);
+            return;
         }
+        int remaining_ms = (int)((deadline - now) * 1000 / frequency);
+        handle_input(game_state, remaining_ms > 1 ? remaining_ms - 1 : 0);
     }
 }
 
-void generate_lakes(Floor* floor) {
-    bool ca_map1[GRID_ROWS][GRID_COLS];
-    bool ca_map2[GRID_ROWS][GRID_COLS];
+// Plays a replay in the window, drawing every turn as fast as frames can be drawn, and
+// reports frames per second. Closing the window or Escape stops it early, which counts as
+// a failed playback since the rest of the recording was never checked.
+bool play_replay(Graphics* graphics, GameState* game_state, const Command* commands, long command_count, const ReplayHeader* header) {
+    long turns = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    while (game_state->is_running && turns < command_count) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            // Other keys would add commands the replay does not have
+            if (event.type != SDL_KEYDOWN) {
+                handle_event(game_state, &event);
+            } else if (key_command(event.key.keysym.sym) == COMMAND_QUIT) {
+                game_state->is_running = false;
+            }
+        }
+        if (!game_state->is_running) {
+            break;
+        }
 
-    // Seed the initial map
-    for (int y = 0; y < GRID_ROWS; y++) {
-        for (int x = 0; x < GRID_COLS; x++) {
-            ca_map1[y][x] = (rand() % 100) < CA_CHANCE_TO_START_ALIVE;
+        apply_command(game_state, commands[turns++]);
+        const Floor* current_floor = update_game(game_state);
+        if (!current_floor) {
+            break;
         }
+        if (game_state->needs_full_redraw) {
+            graphics->map_view.floor_index = -1;
+            game_state->needs_full_redraw = false;
+        }
+        render(graphics, game_state, current_floor);
     }
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-    // Run the simulation
-    for (int i = 0; i < CA_SIMULATION_STEPS; i++) {
-        ca_do_simulation_step(ca_map1, ca_map2);
-        // Swap maps for the next iteration
-        for(int y = 0; y < GRID_ROWS; y++) {
-            for(int x = 0; x < GRID_COLS; x++) {
-                ca_map1[y][x] = ca_map2[y][x];
-            }
-        }
+    printf("%ld turns drawn in %.3f s, %.0f frames/s\n", turns, seconds, turns / seconds);
+    if (turns < command_count) {
+        fprintf(stderr, "Replay stopped after %ld of %ld turns.\n", turns, command_count);
+        return false;
     }
+    return check_replay(game_state, header);
+}
 
-    // Apply the final blob map to the floor
-    for (int y = 0; y < GRID_ROWS; y++) {
-        for (int x = 0; x < GRID_COLS; x++) {
-            if (ca_map1[y][x] && floor->tiles[y][x].type == TILE_GROUND) {
-                floor->tiles[y][x].type = TILE_WATER;
-            }
+void handle_event(GameState* game_state, const SDL_Event* event) {
+    if (event->type == SDL_QUIT) {
+        game_state->is_running = false;
+    } else if (event->type == SDL_WINDOWEVENT) {
+        game_state->needs_redraw = true;
+    } else if (event->type == SDL_RENDER_TARGETS_RESET || event->type == SDL_RENDER_DEVICE_RESET) {
+        game_state->needs_redraw = true;
+        game_state->needs_full_redraw = true;
+    } else if (event->type == SDL_KEYDOWN) {
+        Command command = key_command(event->key.keysym.sym);
+        if (command != COMMAND_NONE) {
+            apply_command(game_state, command);
+            game_state->needs_redraw = true;
         }
     }
 }
 
-
-void carve_room(Floor* floor, SDL_Rect room) {
-    for (int y = room.y; y < room.y + room.h; ++y) {
-        for (int x = room.x; x < room.x + room.w; ++x) {
-            floor->tiles[y][x].type = TILE_GROUND;
-        }
+Command key_command(SDL_Keycode key) {
+    switch (key) {
+        case SDLK_ESCAPE: return COMMAND_QUIT;
+        case SDLK_v: return COMMAND_TOGGLE_SIGHT;
+        case SDLK_t: return COMMAND_TOGGLE_TEXT;
+        case SDLK_F5: return COMMAND_SAVE;
+        case SDLK_UP: case SDLK_k: return COMMAND_MOVE_UP;
+        case SDLK_DOWN: case SDLK_j: return COMMAND_MOVE_DOWN;
+        case SDLK_LEFT: case SDLK_h: return COMMAND_MOVE_LEFT;
+        case SDLK_RIGHT: case SDLK_l: return COMMAND_MOVE_RIGHT;
+        default: return COMMAND_NONE;
+    }
+}
+
+Command script_command(char c) {
+    switch (c) {
+        case 'q': return COMMAND_QUIT;
+        case 'v': return COMMAND_TOGGLE_SIGHT;
+        case 's': return COMMAND_SAVE;
+        case 'k': return COMMAND_MOVE_UP;
+        case 'j': return COMMAND_MOVE_DOWN;
+        case 'h': return COMMAND_MOVE_LEFT;
+        case 'l': return COMMAND_MOVE_RIGHT;
+        default: return COMMAND_NONE;
+    }
+}
+
+void apply_command(GameState* game_state, Command command) {
+    record_command(game_state, command);
+    int next_x = game_state->player.x;
+    int next_y = game_state->player.y;
+
+    switch (command) {
+        case COMMAND_NONE: return;
+        case COMMAND_QUIT: game_state->is_running = false; return;
+        case COMMAND_TOGGLE_SIGHT:
+            // Switch between classic and symmetric sight
+            game_state->fov_mode = game_state->fov_mode == FOV_SHADOWCAST ? FOV_SYMMETRIC : FOV_SHADOWCAST;
+            update_fov(game_state, PLAYER_SIGHT_RADIUS);
+            return;
+        case COMMAND_TOGGLE_TEXT:
+            // Switch between glyphs and solid tiles; needs a font to show glyphs
+            game_state->is_text_mode = !game_state->is_text_mode;
+            return;
+        case COMMAND_SAVE:
+            save_game(game_state, game_state->save_path ? game_state->save_path : SAVE_PATH);
+            return;
+        case COMMAND_MOVE_UP: next_y--; break;
+        case COMMAND_MOVE_DOWN: next_y++; break;
+        case COMMAND_MOVE_LEFT: next_x--; break;
+        case COMMAND_MOVE_RIGHT: next_x++; break;
+    }
+
+    Floor* current_floor = player_floor(game_state);
+    if (!current_floor) {
+        return;
+    }
+    if (next_x < 0 || next_x >= current_floor->width || next_y < 0 || next_y >= current_floor->height) {
+        return;
+    }
+    if (!plane_get(current_floor->passable, current_floor->stride, next_x, next_y)) {
+        return; // Cannot move
+    }
+
+    TileType next_tile_type = get_tile_type(current_floor, next_x, next_y);
+    bool moved = false;
+
+    switch (next_tile_type) {
+        case TILE_STAIRS_DOWN:
+            if (game_state->current_floor_index < game_state->dungeon.floor_count - 1) {
+                // A floor that cannot be built keeps the player where they are
+                Floor* new_floor = dungeon_floor(&game_state->dungeon, game_state->current_floor_index + 1);
+                if (!new_floor) {
+                    fprintf(stderr, "Could not build floor %d.\n", game_state->current_floor_index + 2);
+                    break;
+                }
+                game_state->current_floor_index++;
+                game_state->player.x = new_floor->stairs_up.x;
+                game_state->player.y = new_floor->stairs_up.y;
+                moved = true;
+            }
+            break;
+
+        case TILE_STAIRS_UP:
+            if (game_state->current_floor_index > 0) {
+                Floor* new_floor = dungeon_floor(&game_state->dungeon, game_state->current_floor_index - 1);
+                if (!new_floor) {
+                    fprintf(stderr, "Could not build floor %d.\n", game_state->current_floor_index);
+                    break;
+                }
+                game_state->current_floor_index--;
+                game_state->player.x = new_floor->stairs_down.x;
+                game_state->player.y = new_floor->stairs_down.y;
+                moved = true;
+            }
+            break;
+        
+        default: // Includes TILE_GROUND and TILE_WATER
+            game_state->player.x = next_x;
+            game_state->player.y = next_y;
+            moved = true;
+            break;
+    }
+    if (moved) {
+        update_fov(game_state, PLAYER_SIGHT_RADIUS);
+        if (next_tile_type == TILE_STAIRS_DOWN || next_tile_type == TILE_STAIRS_UP) {
+            dungeon_prefetch(&game_state->dungeon, game_state->current_floor_index);
+        }
+        autosave(game_state);
+    }
+}
+
+// The floor the player is on. If it cannot be rebuilt after eviction there is nowhere to
+// stand, so the game stops.
+Floor* player_floor(GameState* game_state) {
+    Floor* floor = dungeon_floor(&game_state->dungeon, game_state->current_floor_index);
+    if (!floor && game_state->is_running) {
+        fprintf(stderr, "Lost floor %d; stopping.\n", game_state->current_floor_index + 1);
+        game_state->is_running = false;
+    }
+    return floor;
+}
+
+// Returns the player's floor for render(), or NULL once the game has stopped
+Floor* update_game(GameState* game_state) {
+    Floor* current_floor = player_floor(game_state);
+    if (!current_floor) {
+        return NULL;
+    }
+    update_light_map(&game_state->light_map, current_floor, game_state->current_floor_index);
+    return current_floor;
+}
+
+// Draws current_floor, which must be the floor update_game() returned this frame
+void render(Graphics* graphics, const GameState* game_state, const Floor* current_floor) {
+    MapView* view = &graphics->map_view;
+    bool use_glyphs = game_state->is_text_mode && graphics->glyph_atlas;
+    if (view->is_text_mode != use_glyphs) {
+        view->is_text_mode = use_glyphs;
+        view->floor_index = -1;
+    }
+    SDL_Point camera = follow_player(view->camera, view, &game_state->player);
+
+    // Bring the map texture up to date, redrawing only the tiles inside the changed area
+    SDL_Rect area;
+    if (find_map_changes(view, current_floor, game_state, camera, &area)) {
+        SDL_Rect texels = { area.x - camera.x, area.y - camera.y, area.w, area.h };
+        SDL_Rect pixels = { texels.x * TILE_WIDTH, texels.y * TILE_HEIGHT, area.w * TILE_WIDTH, area.h * TILE_HEIGHT };
+        SDL_SetRenderTarget(graphics->renderer, graphics->map_texture);
+        SDL_SetRenderDrawColor(graphics->renderer, 0, 0, 0, 255);
+        SDL_RenderFillRect(graphics->renderer, &pixels);
+        if (use_glyphs) {
+            draw_map_glyphs(graphics->renderer, graphics->glyph_atlas, current_floor, &area, camera);
+        } else {
+            draw_map(graphics->renderer, current_floor, &area, camera);
+        }
+
+        // Shade what is in view by the light reaching it; remembered tiles keep their colours
+        static Uint32 shade[VIEW_ROWS * VIEW_COLS];
+        const LightMap* light_map = &game_state->light_map;
+        bool is_lit = light_map->floor_index == game_state->current_floor_index;
+        for (int y = area.y; y < area.y + area.h; ++y) {
+            for (int x = area.x; x < area.x + area.w; ++x) {
+                Uint32 rgb[3] = { 255, 255, 255 };
+                if (is_lit && plane_get(current_floor->visible, current_floor->stride, x, y)) {
+                    const uint32_t* light = light_at(light_map, x, y); // NULL for chunks no light reaches
+                    for (int c = 0; c < 3; c++) {
+                        rgb[c] = AMBIENT_LIGHT + (light ? light[c] : 0);
+                        if (rgb[c] > 255) rgb[c] = 255;
+                    }
+                }
+                shade[(y - camera.y) * VIEW_COLS + x - camera.x] = (rgb[0] << 24) | (rgb[1] << 16) | (rgb[2] << 8) | 255;
+            }
+        }
+        SDL_UpdateTexture(graphics->light_texture, &texels, &shade[texels.y * VIEW_COLS + texels.x], VIEW_COLS * sizeof(Uint32));
+        SDL_RenderCopy(graphics->renderer, graphics->light_texture, &texels, &pixels);
+        SDL_SetRenderTarget(graphics->renderer, NULL);
+    }
+
+    SDL_RenderCopy(graphics->renderer, graphics->map_texture, NULL, NULL);
+
+    if (plane_get(current_floor->visible, current_floor->stride, game_state->player.x, game_state->player.y)) {
+        int x = game_state->player.x - camera.x;
+        int y = game_state->player.y - camera.y;
+        SDL_Rect player_rect = { x * TILE_WIDTH, y * TILE_HEIGHT, TILE_WIDTH, TILE_HEIGHT };
+        if (use_glyphs) {
+            SDL_SetRenderDrawColor(graphics->renderer, 0, 0, 0, 255);
+            SDL_RenderFillRect(graphics->renderer, &player_rect);
+            draw_glyph(graphics->renderer, graphics->glyph_atlas, x, y, '@', (SDL_Color){ 255, 255, 0, 255 });
+        } else {
+            SDL_SetRenderDrawColor(graphics->renderer, 255, 255, 0, 255);
+            SDL_RenderFillRect(graphics->renderer, &player_rect);
+        }
+    }
+
+    SDL_RenderPresent(graphics->renderer);
+}
+
+// Sizes the view for floors of width x height, with nothing drawn yet
+void map_view_init(MapView* view, int width, int height) {
+    *view = (MapView){ .floor_index = -1, .width = width, .height = height };
+    view->columns = width < VIEW_COLS ? width : VIEW_COLS;
+    view->rows = height < VIEW_ROWS ? height : VIEW_ROWS;
+}
+
+static int follow_axis(int camera, int view_size, int floor_size, int player) {
+    if (player - camera < VIEW_MARGIN || camera + view_size - 1 - player < VIEW_MARGIN) {
+        camera = player - view_size / 2;
+    }
+    if (camera > floor_size - view_size) camera = floor_size - view_size;
+    if (camera < 0) camera = 0;
+    return camera;
+}
+
+// Where the camera should be for the player's position. It stays put until the player comes
+// within VIEW_MARGIN tiles of an edge, then recentres on the player, staying on the floor.
+SDL_Point follow_player(SDL_Point camera, const MapView* view, const Player* player) {
+    return (SDL_Point){
+        follow_axis(camera.x, view->columns, view->width, player->x),
+        follow_axis(camera.y, view->rows, view->height, player->y)
+    };
+}
+
+static void grow_area(SDL_Rect* area, int min_x, int min_y, int max_x, int max_y) {
+    if (area->w == 0) {
+        *area = (SDL_Rect){ min_x, min_y, max_x - min_x + 1, max_y - min_y + 1 };
+        return;
+    }
+    int right = area->x + area->w - 1;
+    int bottom = area->y + area->h - 1;
+    if (min_x < area->x) area->x = min_x;
+    if (min_y < area->y) area->y = min_y;
+    if (max_x > right) right = max_x;
+    if (max_y > bottom) bottom = max_y;
+    area->w = right - area->x + 1;
+    area->h = bottom - area->y + 1;
+}
+
+// Compares the floor with what the map texture shows and records it as drawn. Sets area to
+// the floor tiles covering every change in view: new visibility or memory, edited tiles, and
+// the lit area when the light moved. A new floor or camera position redraws the whole view.
+// Returns false when there is nothing to redraw.
+bool find_map_changes(MapView* view, const Floor* floor, const GameState* game_state, SDL_Point camera, SDL_Rect* area) {
+    const LightMap* light_map = &game_state->light_map;
+    SDL_Rect bounds = { camera.x, camera.y, view->columns, view->rows };
+    bool is_new = view->floor_index != game_state->current_floor_index || view->camera.x != camera.x || view->camera.y != camera.y;
+    *area = is_new ? bounds : (SDL_Rect){0};
+
+    // Visibility and memory, 64 tiles at a time, recording them as drawn as it goes
+    for (int row = 0; row < bounds.h; row++) {
+        int y = bounds.y + row;
+        for (int w = 0; w * 64 < bounds.w; w++) {
+            int x = bounds.x + w * 64;
+            int count = bounds.w - w * 64 < 64 ? bounds.w - w * 64 : 64;
+            uint64_t visible = plane_run(floor->visible, floor->stride, x, y, count);
+            uint64_t explored = plane_run(floor->explored, floor->stride, x, y, count);
+            uint64_t* drawn_visible = &view->visible[row * VIEW_WORDS + w];
+            uint64_t* drawn_explored = &view->explored[row * VIEW_WORDS + w];
+            uint64_t changed = (*drawn_visible ^ visible) | (*drawn_explored ^ explored);
+            if (changed && !is_new) {
+                grow_area(area, x + __builtin_ctzll(changed), y, x + 63 - __builtin_clzll(changed), y);
+            }
+            *drawn_visible = visible;
+            *drawn_explored = explored;
+        }
+    }
+    if (is_new || view->revision != floor->revision) {
+        for (int row = 0; row < bounds.h; row++) {
+            for (int column = 0; column < bounds.w; column++) {
+                uint8_t type = (uint8_t)get_tile_type(floor, bounds.x + column, bounds.y + row);
+                uint8_t* drawn = &view->types[row * VIEW_COLS + column];
+                if (*drawn != type && !is_new) {
+                    grow_area(area, bounds.x + column, bounds.y + row, bounds.x + column, bounds.y + row);
+                }
+                *drawn = type;
+            }
+        }
+    }
+    if (!is_new) {
+        const VisibleArea* visible_area = &game_state->visible_area;
+        if (view->light_generation != light_map->generation && visible_area->floor_index == game_state->current_floor_index && visible_area->min_x <= visible_area->max_x) {
+            SDL_Rect lit = { visible_area->min_x, visible_area->min_y, visible_area->max_x - visible_area->min_x + 1, visible_area->max_y - visible_area->min_y + 1 };
+            if (SDL_IntersectRect(&lit, &bounds, &lit)) {
+                grow_area(area, lit.x, lit.y, lit.x + lit.w - 1, lit.y + lit.h - 1);
+            }
+        }
+    }
+
+    view->floor_index = game_state->current_floor_index;
+    view->revision = floor->revision;
+    view->light_generation = light_map->generation;
+    view->camera = camera;
+    return area->w > 0;
+}
+
+
+// Tile colours by [explored only, visible][type]
+static const SDL_Color tile_colors[2][TILE_TYPE_COUNT] = {
+    { { 20, 20, 20, 255 }, { 60, 60, 60, 255 }, { 80, 40, 20, 255 }, { 20, 40, 80, 255 }, { 15, 25, 70, 255 } },
+    { { 80, 80, 80, 255 }, { 180, 180, 180, 255 }, { 220, 120, 60, 255 }, { 60, 120, 220, 255 }, { 50, 80, 200, 255 } }
+};
+
+// The floor tiles the view shows with the camera at camera, clipped to the floor
+static SDL_Rect view_bounds(const Floor* floor, SDL_Point camera) {
+    SDL_Rect bounds = { camera.x, camera.y, VIEW_COLS, VIEW_ROWS };
+    if (bounds.x + bounds.w > floor->width) bounds.w = floor->width - bounds.x;
+    if (bounds.y + bounds.h > floor->height) bounds.h = floor->height - bounds.y;
+    return bounds;
+}
+
+// Sorts the seen tiles inside area (in floor tiles, NULL for the whole view) into one bucket
+// per colour and fills each bucket with a single call. Tiles are placed relative to camera,
+// and area must lie inside the view. Returns the number of fill calls made.
+int draw_map(SDL_Renderer* renderer, const Floor* floor, const SDL_Rect* area, SDL_Point camera) {
+    enum { BUCKET_COUNT = 2 * TILE_TYPE_COUNT };
+    static SDL_Rect rects[VIEW_ROWS * VIEW_COLS];
+    static uint8_t tile_bucket[VIEW_ROWS * VIEW_COLS];
+    int bucket_start[BUCKET_COUNT + 1] = {0};
+    SDL_Rect bounds = area ? *area : view_bounds(floor, camera);
+
+    // Counting sort: tally each bucket, then place the rects at the bucket offsets
+    for (int y = bounds.y; y < bounds.y + bounds.h; ++y) {
+        for (int x = bounds.x; x < bounds.x + bounds.w; ++x) {
+            int bucket = BUCKET_COUNT; // Unexplored, not drawn
+            if (plane_get(floor->visible, floor->stride, x, y)) {
+                bucket = TILE_TYPE_COUNT + get_tile_type(floor, x, y);
+            } else if (plane_get(floor->explored, floor->stride, x, y)) {
+                bucket = get_tile_type(floor, x, y);
+            }
+            tile_bucket[(y - camera.y) * VIEW_COLS + x - camera.x] = (uint8_t)bucket;
+            bucket_start[bucket]++;
+        }
+    }
+    int offset = 0;
+    for (int b = 0; b <= BUCKET_COUNT; b++) {
+        int count = bucket_start[b];
+        bucket_start[b] = offset;
+        offset += count;
+    }
+
+    int next[BUCKET_COUNT];
+    memcpy(next, bucket_start, sizeof(next));
+    for (int y = bounds.y; y < bounds.y + bounds.h; ++y) {
+        for (int x = bounds.x; x < bounds.x + bounds.w; ++x) {
+            int bucket = tile_bucket[(y - camera.y) * VIEW_COLS + x - camera.x];
+            if (bucket < BUCKET_COUNT) {
+                rects[next[bucket]++] = (SDL_Rect){ (x - camera.x) * TILE_WIDTH, (y - camera.y) * TILE_HEIGHT, TILE_WIDTH, TILE_HEIGHT };
+            }
+        }
+    }
+
+    int calls = 0;
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        int count = bucket_start[b + 1] - bucket_start[b];
+        if (count == 0) continue;
+        SDL_Color color = tile_colors[b / TILE_TYPE_COUNT][b % TILE_TYPE_COUNT];
+        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+        SDL_RenderFillRects(renderer, &rects[bucket_start[b]], count);
+        calls++;
+    }
+    return calls;
+}
+
+
+// --- Glyph Functions ---
+
+#define ATLAS_COLUMNS 16
+
+// Unicode code points for CP437 outside printable ASCII
+static const Uint16 cp437_control[32] = {
+    0x0000, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022, 0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+    0x25BA, 0x25C4, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8, 0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC
+};
+static const Uint16 cp437_high[128] = {
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7, 0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9, 0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA, 0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556, 0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F, 0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B, 0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4, 0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248, 0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0
+};
+
+// CP437 code for each tile type
+static const uint8_t tile_glyphs[TILE_TYPE_COUNT] = { '#', 0xFA, '<', '>', 0xF7 };
+
+static Uint32 cp437_codepoint(int code) {
+    if (code < 32) return cp437_control[code];
+    if (code == 127) return 0x2302;
+    if (code > 127) return cp437_high[code - 128];
+    return (Uint32)code;
+}
+
+// Rasterizes all 256 CP437 glyphs once, white on transparent, so that drawing can tint them
+// per vertex. Glyphs larger than a tile are cropped to the middle of their cell.
+SDL_Texture* build_glyph_atlas(SDL_Renderer* renderer, const char* font_path) {
+    TTF_Font* font = TTF_OpenFont(font_path, TILE_HEIGHT);
+    if (!font) {
+        fprintf(stderr, "Could not open font %s: %s\n", font_path, SDL_GetError());
+        return NULL;
+    }
+    SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_COLUMNS * TILE_WIDTH, (256 / ATLAS_COLUMNS) * TILE_HEIGHT, 32, SDL_PIXELFORMAT_RGBA32);
+    if (!atlas) {
+        fprintf(stderr, "Could not create glyph atlas: %s\n", SDL_GetError());
+        TTF_CloseFont(font);
+        return NULL;
+    }
+
+    for (int code = 1; code < 256; code++) {
+        Uint32 codepoint = cp437_codepoint(code);
+        if (!TTF_GlyphIsProvided32(font, codepoint)) continue;
+        SDL_Surface* glyph = TTF_RenderGlyph32_Blended(font, codepoint, (SDL_Color){ 255, 255, 255, 255 });
+        if (!glyph) continue;
+
+        SDL_Rect source = { 0, 0, glyph->w, glyph->h };
+        SDL_Rect cell = { (code % ATLAS_COLUMNS) * TILE_WIDTH, (code / ATLAS_COLUMNS) * TILE_HEIGHT, TILE_WIDTH, TILE_HEIGHT };
+        if (source.w > TILE_WIDTH) {
+            source.x = (source.w - TILE_WIDTH) / 2;
+            source.w = TILE_WIDTH;
+        }
+        if (source.h > TILE_HEIGHT) {
+            source.y = (source.h - TILE_HEIGHT) / 2;
+            source.h = TILE_HEIGHT;
+        }
+        cell.x += (TILE_WIDTH - source.w) / 2;
+        cell.y += (TILE_HEIGHT - source.h) / 2;
+        SDL_SetSurfaceBlendMode(glyph, SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(glyph, &source, atlas, &cell);
+        SDL_FreeSurface(glyph);
+    }
+    TTF_CloseFont(font);
+
+    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, atlas);
+    SDL_FreeSurface(atlas);
+    if (!texture) {
+        fprintf(stderr, "Could not create glyph atlas texture: %s\n", SDL_GetError());
+        return NULL;
+    }
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    return texture;
+}
+
+// Writes the four corners of a glyph quad at tile (x, y)
+static void glyph_quad(SDL_Vertex* quad, int x, int y, int code, SDL_Color color) {
+    static const float u = 1.0f / ATLAS_COLUMNS;
+    static const float v = 1.0f / (256 / ATLAS_COLUMNS);
+    float left = (float)(x * TILE_WIDTH);
+    float top = (float)(y * TILE_HEIGHT);
+    float tu = (code % ATLAS_COLUMNS) * u;
+    float tv = (code / ATLAS_COLUMNS) * v;
+    quad[0] = (SDL_Vertex){ { left, top }, color, { tu, tv } };
+    quad[1] = (SDL_Vertex){ { left + TILE_WIDTH, top }, color, { tu + u, tv } };
+    quad[2] = (SDL_Vertex){ { left + TILE_WIDTH, top + TILE_HEIGHT }, color, { tu + u, tv + v } };
+    quad[3] = (SDL_Vertex){ { left, top + TILE_HEIGHT }, color, { tu, tv + v } };
+}
+
+void draw_glyph(SDL_Renderer* renderer, SDL_Texture* atlas, int x, int y, int code, SDL_Color color) {
+    static const int indices[6] = { 0, 1, 2, 0, 2, 3 };
+    SDL_Vertex quad[4];
+    glyph_quad(quad, x, y, code, color);
+    SDL_RenderGeometry(renderer, atlas, quad, 4, indices, 6);
+}
+
+// Draws the seen tiles inside area (in floor tiles, NULL for the whole view) as tinted glyphs
+// placed relative to camera, all in one geometry call. Returns the number of draw calls made.
+int draw_map_glyphs(SDL_Renderer* renderer, SDL_Texture* atlas, const Floor* floor, const SDL_Rect* area, SDL_Point camera) {
+    static SDL_Vertex vertices[VIEW_ROWS * VIEW_COLS * 4];
+    static int indices[VIEW_ROWS * VIEW_COLS * 6];
+    static bool has_indices = false;
+    if (!has_indices) {
+        for (int i = 0; i < VIEW_ROWS * VIEW_COLS; i++) {
+            static const int corners[6] = { 0, 1, 2, 0, 2, 3 };
+            for (int c = 0; c < 6; c++) {
+                indices[i * 6 + c] = i * 4 + corners[c];
+            }
+        }
+        has_indices = true;
+    }
+
+    SDL_Rect bounds = area ? *area : view_bounds(floor, camera);
+    int quad_count = 0;
+    for (int y = bounds.y; y < bounds.y + bounds.h; ++y) {
+        for (int x = bounds.x; x < bounds.x + bounds.w; ++x) {
+            int seen = plane_get(floor->visible, floor->stride, x, y) ? 1 : plane_get(floor->explored, floor->stride, x, y) ? 0 : -1;
+            if (seen < 0) continue;
+            TileType type = get_tile_type(floor, x, y);
+            glyph_quad(&vertices[quad_count * 4], x - camera.x, y - camera.y, tile_glyphs[type], tile_colors[seen][type]);
+            quad_count++;
+        }
+    }
+    if (quad_count == 0) {
+        return 0;
+    }
+    SDL_RenderGeometry(renderer, atlas, vertices, quad_count * 4, indices, quad_count * 6);
+    return 1;
+}
+
+
+// --- Random Number Functions ---
+
+void rng_seed(Rng* rng, uint64_t seed, uint64_t stream) {
+    rng->state = 0;
+    rng->inc = (stream << 1) | 1;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
+
+uint32_t rng_next(Rng* rng) {
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rotation = (uint32_t)(old >> 59);
+    return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+}
+
+// Uniform in [0, bound) without modulo bias (Lemire's multiply and reject)
+int rng_range(Rng* rng, int bound) {
+    uint64_t product = (uint64_t)rng_next(rng) * (uint32_t)bound;
+    uint32_t low = (uint32_t)product;
+    if (low < (uint32_t)bound) {
+        uint32_t threshold = -(uint32_t)bound % (uint32_t)bound;
+        while (low < threshold) {
+            product = (uint64_t)rng_next(rng) * (uint32_t)bound;
+            low = (uint32_t)product;
+        }
+    }
+    return (int)(product >> 32);
+}
+
+// Each floor gets its own stream, with the seed scrambled (splitmix64) so that
+// neighbouring master seeds and floor numbers do not give related sequences
+Rng floor_rng(uint64_t master_seed, int floor_index) {
+    uint64_t z = master_seed + 0x9E3779B97F4A7C15ULL * (uint64_t)(floor_index + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    Rng rng;
+    rng_seed(&rng, z, (uint64_t)floor_index);
+    return rng;
+}
+
+
+// --- Arena Functions ---
+
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static ArenaBlock* arena_new_block(size_t capacity, ArenaBlock* previous) {
+    ArenaBlock* block = aligned_alloc(ARENA_ALIGNMENT, ARENA_HEADER + capacity);
+    if (block) {
+        *block = (ArenaBlock){ previous, capacity, 0 };
+    }
+    return block;
+}
+
+// Returns bytes of uninitialised memory, aligned to ARENA_ALIGNMENT, or NULL if the
+// arena needs a new block and none can be had
+void* arena_alloc(Arena* arena, size_t bytes) {
+    bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock* block = arena->block;
+    if (!block || block->capacity - block->used < bytes) {
+        block = arena_new_block(bytes > ARENA_BLOCK_SIZE ? bytes : ARENA_BLOCK_SIZE, arena->block);
+        if (!block) {
+            return NULL;
+        }
+        arena->block = block;
+    }
+    void* memory = (uint8_t*)block + ARENA_HEADER + block->used;
+    block->used += bytes;
+    return memory;
+}
+
+// Gives back every allocation. An arena that had to grow is merged into one block as large
+// as all of them, so the same work fits next time without asking the system again.
+void arena_reset(Arena* arena) {
+    if (!arena->block) {
+        return;
+    }
+    if (!arena->block->previous) {
+        arena->block->used = 0;
+        return;
+    }
+    size_t capacity = 0;
+    for (ArenaBlock* block = arena->block; block; block = block->previous) {
+        capacity += block->capacity;
+    }
+    arena_free(arena);
+    arena->block = arena_new_block(capacity, NULL); // If this fails the arena grows again from nothing
+}
+
+void arena_free(Arena* arena) {
+    while (arena->block) {
+        ArenaBlock* previous = arena->block->previous;
+        free(arena->block);
+        arena->block = previous;
+    }
+}
+
+// Each thread has its own arena for short-lived work such as generation buffers, kept between
+// uses; threads that use it free it before exiting
+static _Thread_local Arena thread_scratch;
+
+Arena* scratch_arena(void) {
+    return &thread_scratch;
+}
+
+void release_scratch_arena(void) {
+    arena_free(&thread_scratch);
+}
+
+
+// --- Dungeon Functions ---
+
+// Bytes an array of a floor takes in its block. Arrays in chunk files start on pages of
+// their own so floor_page() can hand back whole pages of each.
+static size_t floor_section(const Floor* floor, size_t bytes) {
+    size_t align = floor->is_file_backed ? (size_t)sysconf(_SC_PAGESIZE) : sizeof(uint64_t);
+    return (bytes + align - 1) / align * align;
+}
+
+// Points the floor's arrays into its block: chunk headers, tile types, then the bit planes
+static void floor_attach(Floor* floor, void* storage) {
+    uint8_t* block = storage;
+    size_t plane = floor_section(floor, plane_bytes(floor));
+    floor->storage = storage;
+    floor->chunks = (ChunkHeader*)block;
+    block += floor_section(floor, sizeof(ChunkHeader) * floor->chunk_count);
+    floor->types = block;
+    block += floor_section(floor, (size_t)CHUNK_TILES * floor->chunk_count);
+    floor->opaque = (uint64_t*)block;
+    floor->passable = (uint64_t*)(block + plane);
+    floor->visible = (uint64_t*)(block + plane * 2);
+    floor->explored = (uint64_t*)(block + plane * 3);
+}
+
+// Sizes floor for width x height tiles, in the chunk file fd or on the heap when it is -1
+static void floor_layout(Floor* floor, int width, int height, int fd) {
+    *floor = (Floor){ .width = width, .height = height, .stride = (width + 63) / 64, .is_file_backed = fd >= 0, .fd = fd, .page_chunk = { -1, -1 } };
+    floor->chunk_count = floor->stride * ((height + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    floor->storage_bytes = floor_section(floor, sizeof(ChunkHeader) * floor->chunk_count) +
+                           floor_section(floor, (size_t)CHUNK_TILES * floor->chunk_count) +
+                           floor_section(floor, plane_bytes(floor)) * 4;
+}
+
+// Bytes of storage a heap floor of width x height tiles needs
+size_t floor_storage_bytes(int width, int height) {
+    Floor floor;
+    floor_layout(&floor, width, height, -1);
+    return floor.storage_bytes;
+}
+
+// Gives floor empty arrays for width x height tiles. With fd -1 they go in storage, which
+// must hold floor_storage_bytes() and outlive the floor, or in memory of the floor's own when
+// storage is NULL. Otherwise they go in the chunk file fd, which the floor takes over and
+// closes in floor_free().
+bool floor_init(Floor* floor, int width, int height, int fd, void* storage) {
+    floor_layout(floor, width, height, fd);
+    if (!floor->is_file_backed) {
+        if (storage) {
+            memset(storage, 0, floor->storage_bytes);
+        } else {
+            storage = calloc(1, floor->storage_bytes);
+            if (!storage) {
+                return false;
+            }
+            floor->owns_storage = true;
+        }
+        floor_attach(floor, storage);
+        return true;
+    }
+    if (ftruncate(fd, (off_t)floor->storage_bytes) != 0) {
+        fprintf(stderr, "Could not size the chunk file for a %dx%d floor.\n", width, height);
+        close(fd);
+        floor->is_file_backed = false;
+        return false;
+    }
+    if (!floor_map(floor)) {
+        floor_free(floor);
+        return false;
+    }
+    return true;
+}
+
+void floor_free(Floor* floor) {
+    if (floor->is_file_backed) {
+        floor_unmap(floor);
+        close(floor->fd);
+    } else if (floor->owns_storage) {
+        free(floor->storage);
+    }
+    *floor = (Floor){0};
+}
+
+// Copies every tile and light of from into to, a floor of the same size, whatever their storage
+static void floor_copy(Floor* to, const Floor* from) {
+    memcpy(to->chunks, from->chunks, sizeof(ChunkHeader) * from->chunk_count);
+    memcpy(to->types, from->types, (size_t)CHUNK_TILES * from->chunk_count);
+    memcpy(to->opaque, from->opaque, plane_bytes(from));
+    memcpy(to->passable, from->passable, plane_bytes(from));
+    memcpy(to->visible, from->visible, plane_bytes(from));
+    memcpy(to->explored, from->explored, plane_bytes(from));
+    to->stairs_up = from->stairs_up;
+    to->stairs_down = from->stairs_down;
+    memcpy(to->lights, from->lights, sizeof(LightSource) * from->light_count);
+    to->light_count = from->light_count;
+    to->revision = from->revision;
+}
+
+// Maps a file-backed floor's chunk file back in. Pages are read from the file as they are touched.
+bool floor_map(Floor* floor) {
+    void* storage = mmap(NULL, floor->storage_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, floor->fd, 0);
+    if (storage == MAP_FAILED) {
+        fprintf(stderr, "Could not map the chunk file of a %dx%d floor.\n", floor->width, floor->height);
+        return false;
+    }
+    floor_attach(floor, storage);
+    floor->page_chunk = (SDL_Point){ -1, -1 };
+    return true;
+}
+
+// Unmaps a file-backed floor, leaving everything in its chunk file
+void floor_unmap(Floor* floor) {
+    if (floor->storage) {
+        munmap(floor->storage, floor->storage_bytes);
+    }
+    floor->storage = NULL;
+    floor->chunks = NULL;
+    floor->types = NULL;
+    floor->opaque = floor->passable = floor->visible = floor->explored = NULL;
+}
+
+// Advises the kernel about chunks [first, end) of an array with chunk_bytes per chunk. Pages
+// to drop are rounded inwards so chunks sharing a page with wanted ones stay put.
+static void advise_chunks(void* array, size_t chunk_bytes, size_t first, size_t end, int advice) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = first * chunk_bytes;
+    size_t stop = end * chunk_bytes;
+    if (advice == MADV_DONTNEED) {
+        start = (start + page - 1) / page * page;
+        stop = stop / page * page;
+    } else {
+        start = start / page * page;
+        stop = (stop + page - 1) / page * page;
+    }
+    if (start < stop) {
+        madvise((uint8_t*)array + start, stop - start, advice);
+    }
+}
+
+// Keeps the chunks within CHUNK_RESIDENT_RADIUS of tile (x, y) of a file-backed floor in memory
+// and lets the kernel drop the rest, which are read back from the chunk file if touched again.
+// x = -1 lets every chunk go. Chunk headers always stay. Heap floors are left alone.
+void floor_page(Floor* floor, int x, int y) {
+    SDL_Point chunk = { x < 0 ? -1 : x >> CHUNK_SHIFT, y < 0 ? -1 : y >> CHUNK_SHIFT };
+    if (!floor->is_file_backed || !floor->storage || (chunk.x == floor->page_chunk.x && chunk.y == floor->page_chunk.y)) {
+        return;
+    }
+    floor->page_chunk = chunk;
+
+    struct { void* array; size_t chunk_bytes; } arrays[] = {
+        { floor->types, CHUNK_TILES },
+        { floor->opaque, sizeof(uint64_t) * CHUNK_SIZE },
+        { floor->passable, sizeof(uint64_t) * CHUNK_SIZE },
+        { floor->visible, sizeof(uint64_t) * CHUNK_SIZE },
+        { floor->explored, sizeof(uint64_t) * CHUNK_SIZE }
+    };
+    int chunk_rows = floor->chunk_count / floor->stride;
+    int left = chunk.x - CHUNK_RESIDENT_RADIUS < 0 ? 0 : chunk.x - CHUNK_RESIDENT_RADIUS;
+    int right = chunk.x + CHUNK_RESIDENT_RADIUS >= floor->stride ? floor->stride - 1 : chunk.x + CHUNK_RESIDENT_RADIUS;
+    int top = chunk.y - CHUNK_RESIDENT_RADIUS < 0 ? 0 : chunk.y - CHUNK_RESIDENT_RADIUS;
+    int bottom = chunk.y + CHUNK_RESIDENT_RADIUS >= chunk_rows ? chunk_rows - 1 : chunk.y + CHUNK_RESIDENT_RADIUS;
+    if (chunk.x < 0) {
+        top = 0;
+        bottom = -1;
+    }
+
+    for (size_t a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++) {
+        // Chunks are in row-major order, so the window is one run per chunk row with gaps between
+        size_t released = 0;
+        for (int row = top; row <= bottom; row++) {
+            size_t first = (size_t)row * floor->stride + left;
+            size_t end = (size_t)row * floor->stride + right + 1;
+            advise_chunks(arrays[a].array, arrays[a].chunk_bytes, released, first, MADV_DONTNEED);
+            advise_chunks(arrays[a].array, arrays[a].chunk_bytes, first, end, MADV_WILLNEED);
+            released = end;
+        }
+        advise_chunks(arrays[a].array, arrays[a].chunk_bytes, released, floor->chunk_count, MADV_DONTNEED);
+    }
+}
+
+// Opens an unnamed chunk file for a floor of the dungeon, or returns -1 to use the heap:
+// when no chunk directory was given and floors are small, or the file cannot be made.
+static int open_chunk_file(const Dungeon* dungeon) {
+    const char* dir = dungeon->chunk_dir;
+    if (!dir) {
+        if ((long long)dungeon->width * dungeon->height < CHUNK_FILE_MIN_TILES) {
+            return -1;
+        }
+        dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/rogue-floor-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create a chunk file in %s, keeping the floor on the heap.\n", dir);
+        return -1;
+    }
+    unlink(path); // Gone from the directory at once; the space is freed when the floor is
+    return fd;
+}
+
+// Every floor of the dungeon starts with its Floor and then its dirty chunk bits in the
+// dungeon's arena. Heap floors keep their storage straight after.
+#define FLOOR_HEADER_BYTES ((sizeof(Floor) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static size_t dirty_chunk_bytes(int width, int height) {
+    size_t chunk_count = (size_t)((width + 63) / 64) * ((height + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    return (chunk_count + 63) / 64 * sizeof(uint64_t);
+}
+
+static size_t floor_header_bytes(const Dungeon* dungeon) {
+    size_t dirty_bytes = dirty_chunk_bytes(dungeon->width, dungeon->height);
+    return FLOOR_HEADER_BYTES + ((dirty_bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1));
+}
+
+// Points a floor of the dungeon at its dirty chunk bits, all clear
+static void attach_dirty_chunks(Floor* floor) {
+    floor->dirty_chunks = (uint64_t*)((uint8_t*)floor + FLOOR_HEADER_BYTES);
+    memset(floor->dirty_chunks, 0, dirty_chunk_bytes(floor->width, floor->height));
+}
+
+// Memory for a floor of the dungeon: an evicted heap floor's, else more of the arena.
+// NULL if the arena cannot grow.
+static Floor* take_floor(Dungeon* dungeon, bool is_file_backed) {
+    SDL_LockMutex(dungeon->lock);
+    Floor* floor;
+    if (!is_file_backed && dungeon->spare_floors) {
+        floor = dungeon->spare_floors;
+        dungeon->spare_floors = floor->next_spare;
+    } else if (is_file_backed) {
+        floor = arena_alloc(&dungeon->arena, floor_header_bytes(dungeon));
+    } else {
+        floor = arena_alloc(&dungeon->arena, floor_header_bytes(dungeon) + floor_storage_bytes(dungeon->width, dungeon->height));
+    }
+    SDL_UnlockMutex(dungeon->lock);
+    return floor;
+}
+
+// Hands a heap floor's memory back for the next floor built. Caller holds the lock.
+static void spare_floor(Dungeon* dungeon, Floor* floor) {
+    floor->next_spare = dungeon->spare_floors;
+    dungeon->spare_floors = floor;
+}
+
+// Generates floor index from its own stream and fixes up the stairs at either end of the dungeon
+static Floor* build_floor(Dungeon* dungeon, int index) {
+    int fd = open_chunk_file(dungeon);
+    Floor* floor = take_floor(dungeon, fd >= 0);
+    if (!floor) {
+        fprintf(stderr, "Failed to allocate memory for floor %d.\n", index + 1);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if (!floor_init(floor, dungeon->width, dungeon->height, fd, fd < 0 ? (uint8_t*)floor + floor_header_bytes(dungeon) : NULL)) {
+        return NULL; // Only chunk files fail here; the Floor stays in the arena until the dungeon goes
+    }
+    Rng rng = floor_rng(dungeon->seed, index);
+    if (!generate_floor(floor, &rng)) {
+        SDL_LockMutex(dungeon->lock);
+        if (floor->is_file_backed) {
+            floor_free(floor);
+        } else {
+            spare_floor(dungeon, floor);
+        }
+        SDL_UnlockMutex(dungeon->lock);
+        return NULL;
+    }
+    if (index == 0) {
+        set_tile_type(floor, floor->stairs_up.x, floor->stairs_up.y, TILE_GROUND);
+        remove_lights_at(floor, floor->stairs_up.x, floor->stairs_up.y);
+    }
+    if (index == dungeon->floor_count - 1) {
+        set_tile_type(floor, floor->stairs_down.x, floor->stairs_down.y, TILE_GROUND);
+        remove_lights_at(floor, floor->stairs_down.x, floor->stairs_down.y);
+    }
+    attach_dirty_chunks(floor); // Its slot is marked unsaved, so the next save copies it whole
+    floor_page(floor, -1, -1); // Nobody is on it yet
+    return floor;
+}
+
+// Makes room for slot index. Caller holds the lock.
+static bool reserve_slots(Dungeon* dungeon, int index) {
+    if (index < dungeon->slot_count) {
+        return true;
+    }
+    int slot_count = dungeon->slot_count ? dungeon->slot_count : 16;
+    while (slot_count <= index) {
+        slot_count *= 2;
+    }
+    FloorSlot* slots = realloc(dungeon->slots, sizeof(FloorSlot) * slot_count);
+    if (!slots) {
+        return false;
+    }
+    memset(slots + dungeon->slot_count, 0, sizeof(FloorSlot) * (slot_count - dungeon->slot_count));
+    dungeon->slots = slots;
+    dungeon->slot_count = slot_count;
+    return true;
+}
+
+// Hands a finished floor to its slot, restoring what the player remembered of it. Caller holds the lock.
+static void publish_floor(Dungeon* dungeon, int index, Floor* floor) {
+    FloorSlot* slot = &dungeon->slots[index];
+    if (floor && slot->explored) {
+        memcpy(floor->explored, slot->explored, plane_bytes(floor));
+    }
+    slot->floor = floor;
+    slot->is_pending = false;
+    slot->is_saved = false;
+    if (floor) {
+        dungeon->resident_count++;
+    }
+    SDL_CondBroadcast(dungeon->floor_ready);
+}
+
+static int dungeon_prefetcher(void* data) {
+    Dungeon* dungeon = data;
+    SDL_LockMutex(dungeon->lock);
+    for (;;) {
+        while (!dungeon->is_shutting_down && dungeon->requests[0] < 0 && dungeon->requests[1] < 0) {
+            SDL_CondWait(dungeon->work_ready, dungeon->lock);
+        }
+        if (dungeon->is_shutting_down) {
+            break;
+        }
+        int r = dungeon->requests[0] >= 0 ? 0 : 1;
+        int index = dungeon->requests[r];
+        dungeon->requests[r] = -1;
+
+        SDL_UnlockMutex(dungeon->lock);
+        Floor* floor = build_floor(dungeon, index);
+        SDL_LockMutex(dungeon->lock);
+        publish_floor(dungeon, index, floor);
+    }
+    SDL_UnlockMutex(dungeon->lock);
+
+    release_scratch_arena();
+    return 0;
+}
+
+bool dungeon_init(Dungeon* dungeon, int floor_count, int width, int height, uint64_t seed) {
+    *dungeon = (Dungeon){ .floor_count = floor_count, .width = width, .height = height, .seed = seed, .requests = { -1, -1 } };
+    dungeon->lock = SDL_CreateMutex();
+    dungeon->work_ready = SDL_CreateCond();
+    dungeon->floor_ready = SDL_CreateCond();
+    if (!dungeon->lock || !dungeon->work_ready || !dungeon->floor_ready || !reserve_slots(dungeon, 1)) {
+        fprintf(stderr, "Could not set up the dungeon: %s\n", SDL_GetError());
+        dungeon_free(dungeon);
+        return false;
+    }
+    dungeon->prefetcher = SDL_CreateThread(dungeon_prefetcher, "prefetch", dungeon);
+    if (!dungeon->prefetcher) {
+        fprintf(stderr, "Could not create prefetch thread: %s\n", SDL_GetError());
+        dungeon_free(dungeon);
+        return false;
+    }
+    return true;
+}
+
+void dungeon_free(Dungeon* dungeon) {
+    if (dungeon->prefetcher) {
+        SDL_LockMutex(dungeon->lock);
+        dungeon->is_shutting_down = true;
+        SDL_CondBroadcast(dungeon->work_ready);
+        SDL_UnlockMutex(dungeon->lock);
+        SDL_WaitThread(dungeon->prefetcher, NULL);
+    }
+    // Chunk files are closed one by one; all other memory goes with the arena and the save mapping
+    for (int i = 0; i < dungeon->slot_count; i++) {
+        if (dungeon->slots[i].floor && dungeon->slots[i].floor->is_file_backed) {
+            floor_free(dungeon->slots[i].floor);
+        }
+    }
+    arena_free(&dungeon->arena);
+    if (dungeon->save_map) {
+        munmap(dungeon->save_map, dungeon->save_bytes);
+    }
+    free(dungeon->slots);
+    if (dungeon->floor_ready) SDL_DestroyCond(dungeon->floor_ready);
+    if (dungeon->work_ready) SDL_DestroyCond(dungeon->work_ready);
+    if (dungeon->lock) SDL_DestroyMutex(dungeon->lock);
+    *dungeon = (Dungeon){ .requests = { -1, -1 } };
+}
+
+// Returns floor index, generating it here if the prefetch thread has not got to it yet.
+// NULL when the floor cannot be allocated, built or mapped back in from its chunk file.
+Floor* dungeon_floor(Dungeon* dungeon, int index) {
+    SDL_LockMutex(dungeon->lock);
+    if (!reserve_slots(dungeon, index)) {
+        SDL_UnlockMutex(dungeon->lock);
+        return NULL;
+    }
+    FloorSlot* slot = &dungeon->slots[index];
+    if (!slot->floor && !slot->is_pending) {
+        // Nobody is building it, so build it now
+        slot->is_pending = true;
+        SDL_UnlockMutex(dungeon->lock);
+        Floor* floor = build_floor(dungeon, index);
+        SDL_LockMutex(dungeon->lock);
+        publish_floor(dungeon, index, floor);
+    }
+    while (dungeon->slots[index].is_pending) {
+        SDL_CondWait(dungeon->floor_ready, dungeon->lock);
+    }
+    Floor* floor = dungeon->slots[index].floor;
+    if (floor && !floor->storage) {
+        // Evicted but still in its chunk file
+        if (floor_map(floor)) {
+            dungeon->resident_count++;
+        } else {
+            floor = NULL;
+        }
+    }
+    SDL_UnlockMutex(dungeon->lock);
+    return floor;
+}
+
+// Queues the floors either side of current_index and evicts the floors farthest from it
+// once more than MAX_RESIDENT_FLOORS are in memory. The current floor and its neighbours
+// are never evicted. Floors with a chunk file are only unmapped, keeping their file.
+void dungeon_prefetch(Dungeon* dungeon, int current_index) {
+    SDL_LockMutex(dungeon->lock);
+    int neighbours[2] = { current_index + 1, current_index - 1 };
+    for (int r = 0; r < 2; r++) {
+        int index = neighbours[r];
+        if (dungeon->requests[r] >= 0) {
+            // Still queued for a floor the player has moved away from
+            dungeon->slots[dungeon->requests[r]].is_pending = false;
+            dungeon->requests[r] = -1;
+        }
+        if (index < 0 || index >= dungeon->floor_count || !reserve_slots(dungeon, index)) continue;
+        FloorSlot* slot = &dungeon->slots[index];
+        if (slot->floor || slot->is_pending) continue;
+        slot->is_pending = true;
+        dungeon->requests[r] = index;
+    }
+    SDL_CondSignal(dungeon->work_ready);
+
+    while (dungeon->resident_count > MAX_RESIDENT_FLOORS) {
+        int farthest = -1;
+        for (int i = 0; i < dungeon->slot_count; i++) {
+            const Floor* floor = dungeon->slots[i].floor;
+            if (floor && floor->storage && abs(i - current_index) > 1 && (farthest < 0 || abs(i - current_index) > abs(farthest - current_index))) {
+                farthest = i;
+            }
+        }
+        if (farthest < 0) {
+            break;
+        }
+        FloorSlot* slot = &dungeon->slots[farthest];
+        if (slot->floor->is_save_view) {
+            // A floor loaded from a save moves to a chunk file if the dungeon's floors get one,
+            // so its changes are kept like theirs
+            int fd = open_chunk_file(dungeon);
+            Floor loaded = *slot->floor;
+            if (fd >= 0 && floor_init(slot->floor, loaded.width, loaded.height, fd, NULL)) {
+                floor_copy(slot->floor, &loaded);
+                slot->floor->dirty_chunks = loaded.dirty_chunks;
+            } else {
+                *slot->floor = loaded;
+            }
+        }
+        if (slot->floor->is_file_backed) {
+            floor_unmap(slot->floor);
+            dungeon->resident_count--;
+            continue;
+        }
+        if (!slot->explored) {
+            slot->explored = arena_alloc(&dungeon->arena, plane_bytes(slot->floor));
+            if (!slot->explored) {
+                break; // Keep it rather than forget what was seen
+            }
+        }
+        memcpy(slot->explored, slot->floor->explored, plane_bytes(slot->floor));
+        if (!slot->floor->is_save_view) {
+            spare_floor(dungeon, slot->floor); // Floors from a save have no arena storage to reuse
+        }
+        slot->floor = NULL;
+        slot->is_saved = false; // Saved whole last time, if at all
+        dungeon->resident_count--;
+    }
+    SDL_UnlockMutex(dungeon->lock);
+}
+
+
+// --- Save Functions ---
+
+// A chunk copied into a snapshot: its header, tile types, then its opaque, passable and explored words
+#define SNAPSHOT_CHUNK_BYTES (sizeof(ChunkHeader) + CHUNK_TILES + 3 * sizeof(uint64_t) * CHUNK_SIZE)
+
+static uint64_t save_align(uint64_t bytes) {
+    return (bytes + SAVE_ALIGNMENT - 1) / SAVE_ALIGNMENT * SAVE_ALIGNMENT;
+}
+
+// Writes bytes of data, NULL for zeros, then zeros up to padded bytes
+static bool write_padded(FILE* file, const void* data, size_t bytes, size_t padded) {
+    static const uint8_t zeros[SAVE_ALIGNMENT];
+    if (data && bytes > 0 && fwrite(data, 1, bytes, file) != bytes) {
+        return false;
+    }
+    for (size_t left = data ? padded - bytes : padded; left > 0;) {
+        size_t count = left < sizeof(zeros) ? left : sizeof(zeros);
+        if (fwrite(zeros, 1, count, file) != count) {
+            return false;
+        }
+        left -= count;
+    }
+    return true;
+}
+
+// Copies the chunks of floor changed since the last save into the snapshot, or every chunk
+// when the last save does not have the floor, and clears its dirty bits
+static bool snapshot_floor(Arena* arena, SnapshotFloor* snapshot, Floor* floor) {
+    size_t words = ((size_t)floor->chunk_count + 63) / 64;
+    uint64_t* copied = arena_alloc(arena, words * sizeof(uint64_t));
+    if (!copied) {
+        return false;
+    }
+    size_t copy_count = 0;
+    for (size_t w = 0; w < words; w++) {
+        copied[w] = snapshot->shared ? floor->dirty_chunks[w] : ~0ULL;
+        copy_count += __builtin_popcountll(copied[w]);
+    }
+    if (floor->chunk_count % 64 && !snapshot->shared) {
+        copied[words - 1] &= (1ULL << (floor->chunk_count % 64)) - 1;
+        copy_count -= 64 - floor->chunk_count % 64;
+    }
+    snapshot->copied = copied;
+    if (copy_count == 0) {
+        return true;
+    }
+
+    uint8_t* record = arena_alloc(arena, copy_count * SNAPSHOT_CHUNK_BYTES);
+    bool was_mapped = floor->storage != NULL;
+    if (!record || (!was_mapped && !floor_map(floor))) {
+        return false; // Evicted floors still in their chunk file are mapped just for the copy
+    }
+    snapshot->copy = record;
+    size_t plane_chunk = sizeof(uint64_t) * CHUNK_SIZE;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = copied[w]; bits; bits &= bits - 1) {
+            size_t c = w * 64 + __builtin_ctzll(bits);
+            memcpy(record, &floor->chunks[c], sizeof(ChunkHeader));
+            memcpy(record + sizeof(ChunkHeader), floor->types + c * CHUNK_TILES, CHUNK_TILES);
+            record += sizeof(ChunkHeader) + CHUNK_TILES;
+            memcpy(record, floor->opaque + c * CHUNK_SIZE, plane_chunk);
+            memcpy(record + plane_chunk, floor->passable + c * CHUNK_SIZE, plane_chunk);
+            memcpy(record + plane_chunk * 2, floor->explored + c * CHUNK_SIZE, plane_chunk);
+            record += plane_chunk * 3;
+        }
+    }
+    if (!was_mapped) {
+        floor_unmap(floor);
+    }
+    memset(floor->dirty_chunks, 0, words * sizeof(uint64_t));
+    return true;
+}
+
+// Writes one array of a snapshot floor's section, chunk_bytes per chunk: copied chunks from
+// record_offset into their records, the rest from array_offset in the shared section. Then
+// zeros up to padded bytes.
+static bool write_snapshot_array(FILE* file, const SnapshotFloor* snapshot, int chunk_count, size_t array_offset,
+                                 size_t record_offset, size_t chunk_bytes, size_t padded) {
+    const uint8_t* record = snapshot->copy ? snapshot->copy + record_offset : NULL;
+    for (int c = 0; c < chunk_count;) {
+        if ((snapshot->copied[c >> 6] >> (c & 63)) & 1) {
+            if (fwrite(record, 1, chunk_bytes, file) != chunk_bytes) {
+                return false;
+            }
+            record += SNAPSHOT_CHUNK_BYTES;
+            c++;
+            continue;
+        }
+        // Shared chunks in a row are one run of the last save
+        int end = c + 1;
+        while (end < chunk_count && !((snapshot->copied[end >> 6] >> (end & 63)) & 1)) {
+            end++;
+        }
+        size_t bytes = (size_t)(end - c) * chunk_bytes;
+        if (fwrite(snapshot->shared + array_offset + (size_t)c * chunk_bytes, 1, bytes, file) != bytes) {
+            return false;
+        }
+        c = end;
+    }
+    return write_padded(file, NULL, 0, padded - (size_t)chunk_count * chunk_bytes);
+}
+
+// Writes a snapshot floor's section as floor_attach() lays out a heap floor. The visible
+// plane is written clear: nothing is lit until the player arrives.
+static bool write_snapshot_floor(FILE* file, const SnapshotFloor* snapshot, int width, int height) {
+    Floor layout;
+    floor_layout(&layout, width, height, -1);
+    int count = layout.chunk_count;
+    size_t plane_chunk = sizeof(uint64_t) * CHUNK_SIZE;
+    size_t header_section = floor_section(&layout, sizeof(ChunkHeader) * count);
+    size_t type_section = floor_section(&layout, (size_t)CHUNK_TILES * count);
+    size_t plane = floor_section(&layout, plane_bytes(&layout));
+    size_t opaque = header_section + type_section;
+    size_t words = sizeof(ChunkHeader) + CHUNK_TILES; // Where a record's plane words start
+    return write_snapshot_array(file, snapshot, count, 0, 0, sizeof(ChunkHeader), header_section) &&
+           write_snapshot_array(file, snapshot, count, header_section, sizeof(ChunkHeader), CHUNK_TILES, type_section) &&
+           write_snapshot_array(file, snapshot, count, opaque, words, plane_chunk, plane) &&
+           write_snapshot_array(file, snapshot, count, opaque + plane, words + plane_chunk, plane_chunk, plane) &&
+           write_padded(file, NULL, 0, plane) &&
+           write_snapshot_array(file, snapshot, count, opaque + plane * 3, words + plane_chunk * 2, plane_chunk, plane) &&
+           write_padded(file, NULL, 0, save_align(layout.storage_bytes) - layout.storage_bytes);
+}
+
+// Writes the snapshot next to its path, syncs it and renames it over the path, so a failed
+// save keeps the last one and a game loaded from the path keeps reading the file it mapped.
+// The new file becomes the last save.
+static bool write_snapshot(Saver* saver) {
+    char temp_path[sizeof(saver->path) + 4];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", saver->path);
+    FILE* file = fopen(temp_path, "w+b"); // Readable too, to be mapped once written
+    if (!file) {
+        fprintf(stderr, "Could not create %s.\n", temp_path);
+        return false;
+    }
+
+    const SaveHeader* header = &saver->header;
+    size_t table_bytes = sizeof(SaveFloor) * header->saved_floor_count;
+    bool is_written = write_padded(file, header, sizeof(SaveHeader), sizeof(SaveHeader));
+    for (int n = 0; n < header->saved_floor_count && is_written; n++) {
+        is_written = write_padded(file, &saver->floors[n].entry, sizeof(SaveFloor), sizeof(SaveFloor));
+    }
+    is_written = is_written && write_padded(file, NULL, 0, save_align(sizeof(SaveHeader) + table_bytes) - sizeof(SaveHeader) - table_bytes);
+    for (int n = 0; n < header->saved_floor_count && is_written; n++) {
+        const SnapshotFloor* snapshot = &saver->floors[n];
+        if (snapshot->entry.kind == SAVE_FLOOR_EXPLORED) {
+            const uint8_t* plane = snapshot->shared ? snapshot->shared : snapshot->copy;
+            is_written = write_padded(file, plane, snapshot->entry.bytes, save_align(snapshot->entry.bytes));
+        } else {
+            is_written = write_snapshot_floor(file, snapshot, header->width, header->height);
+        }
+    }
+
+    // On disk before it replaces the last save, and mapped for the next save to share from
+    void* map = MAP_FAILED;
+    if (is_written && fflush(file) == 0 && fsync(fileno(file)) == 0) {
+        map = mmap(NULL, header->file_bytes, PROT_READ, MAP_SHARED, fileno(file), 0);
+    }
+    is_written = fclose(file) == 0 && map != MAP_FAILED;
+    if (!is_written || rename(temp_path, saver->path) != 0) {
+        fprintf(stderr, "Could not save the game to %s.\n", saver->path);
+        if (map != MAP_FAILED) munmap(map, header->file_bytes);
+        remove(temp_path);
+        return false;
+    }
+
+    // The rename is only durable once the directory holding it is synced
+    char dir[sizeof(saver->path)];
+    snprintf(dir, sizeof(dir), "%s", saver->path);
+    char* slash = strrchr(dir, '/');
+    if (slash == dir) {
+        slash[1] = '\0';
+    } else if (slash) {
+        *slash = '\0';
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    int dir_fd = open(dir, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    if (saver->last_map) {
+        munmap(saver->last_map, saver->last_bytes);
+    }
+    saver->last_map = map;
+    saver->last_bytes = header->file_bytes;
+    return true;
+}
+
+static int save_thread(void* data) {
+    Saver* saver = data;
+    SDL_LockMutex(saver->lock);
+    for (;;) {
+        while (!saver->has_work && !saver->is_shutting_down) {
+            SDL_CondWait(saver->work_ready, saver->lock);
+        }
+        if (!saver->has_work) {
+            break; // Shutting down with every snapshot written
+        }
+        SDL_UnlockMutex(saver->lock);
+        bool is_saved = write_snapshot(saver);
+        if (!is_saved && saver->last_map) {
+            // The snapshot took the floors' dirty chunks with it, so the next save copies everything
+            munmap(saver->last_map, saver->last_bytes);
+            saver->last_map = NULL;
+        }
+        SDL_LockMutex(saver->lock);
+        saver->has_failed = !is_saved;
+        saver->has_work = false;
+        SDL_CondBroadcast(saver->work_done);
+    }
+    SDL_UnlockMutex(saver->lock);
+    return 0;
+}
+
+static bool saver_start(Saver* saver) {
+    saver->lock = SDL_CreateMutex();
+    saver->work_ready = SDL_CreateCond();
+    saver->work_done = SDL_CreateCond();
+    if (saver->lock && saver->work_ready && saver->work_done) {
+        saver->thread = SDL_CreateThread(save_thread, "save", saver);
+    }
+    if (!saver->thread) {
+        fprintf(stderr, "Could not create save thread: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Waits for the save being written, if any, and returns whether the last save succeeded
+bool finish_save(Saver* saver) {
+    if (!saver->thread) {
+        return !saver->has_failed;
+    }
+    SDL_LockMutex(saver->lock);
+    while (saver->has_work) {
+        SDL_CondWait(saver->work_done, saver->lock);
+    }
+    bool is_saved = !saver->has_failed;
+    SDL_UnlockMutex(saver->lock);
+    return is_saved;
+}
+
+// Stops the save thread once it has written the snapshot it was given
+void saver_free(Saver* saver) {
+    if (saver->thread) {
+        SDL_LockMutex(saver->lock);
+        saver->is_shutting_down = true;
+        SDL_CondSignal(saver->work_ready);
+        SDL_UnlockMutex(saver->lock);
+        SDL_WaitThread(saver->thread, NULL);
+    }
+    if (saver->work_done) SDL_DestroyCond(saver->work_done);
+    if (saver->work_ready) SDL_DestroyCond(saver->work_ready);
+    if (saver->lock) SDL_DestroyMutex(saver->lock);
+    arena_free(&saver->arena);
+    if (saver->last_map) {
+        munmap(saver->last_map, saver->last_bytes);
+    }
+    *saver = (Saver){0};
+}
+
+// Saves the game to path: every floor in memory whole, and what was seen of evicted ones.
+// Only a snapshot is taken here, copying what changed since the last save; the save thread
+// writes it while play goes on. Waits only for a save still being written. Returns false if
+// no snapshot could be taken; the save thread reports saves it cannot write.
+bool save_game(GameState* game_state, const char* path) {
+    Saver* saver = &game_state->saver;
+    if (!saver->thread && !saver_start(saver)) {
+        return false;
+    }
+    finish_save(saver); // The thread is idle from here, so the snapshot is ours to fill
+    snprintf(saver->path, sizeof(saver->path), "%s", path);
+    arena_reset(&saver->arena);
+
+    Dungeon* dungeon = &game_state->dungeon;
+    SDL_LockMutex(dungeon->lock); // Keeps the prefetch thread from changing slots meanwhile
+    int saved_floor_count = 0;
+    for (int i = 0; i < dungeon->slot_count; i++) {
+        saved_floor_count += dungeon->slots[i].floor || dungeon->slots[i].explored;
+    }
+    saver->floors = arena_alloc(&saver->arena, sizeof(SnapshotFloor) * (saved_floor_count > 0 ? saved_floor_count : 1));
+    bool is_taken = saver->floors != NULL;
+
+    // Each section's offset follows from the sizes before it. Floors are found in the last
+    // save by walking its table alongside, as both are in slot order.
+    size_t storage_bytes = floor_storage_bytes(dungeon->width, dungeon->height);
+    size_t explored_bytes = plane_words(dungeon->width, dungeon->height) * sizeof(uint64_t);
+    uint64_t offset = save_align(sizeof(SaveHeader) + sizeof(SaveFloor) * saved_floor_count);
+    const SaveHeader* last = saver->last_map;
+    const SaveFloor* last_floors = last ? (const SaveFloor*)(last + 1) : NULL;
+    int last_count = last ? last->saved_floor_count : 0;
+    for (int i = 0, n = 0, cursor = 0; i < dungeon->slot_count && is_taken; i++) {
+        FloorSlot* slot = &dungeon->slots[i];
+        if (!slot->floor && !slot->explored) continue;
+        SnapshotFloor* snapshot = &saver->floors[n++];
+        memset(snapshot, 0, sizeof(SnapshotFloor));
+        SaveFloor* entry = &snapshot->entry;
+        entry->index = i;
+        entry->offset = offset;
+        if (slot->floor) {
+            const Floor* floor = slot->floor;
+            entry->kind = SAVE_FLOOR_WHOLE;
+            entry->bytes = storage_bytes;
+            entry->stairs_up_x = floor->stairs_up.x;
+            entry->stairs_up_y = floor->stairs_up.y;
+            entry->stairs_down_x = floor->stairs_down.x;
+            entry->stairs_down_y = floor->stairs_down.y;
+            entry->revision = floor->revision;
+            entry->light_count = floor->light_count;
+            memcpy(entry->lights, floor->lights, sizeof(LightSource) * floor->light_count);
+        } else {
+            entry->kind = SAVE_FLOOR_EXPLORED;
+            entry->bytes = explored_bytes;
+        }
+        offset += save_align(entry->bytes);
+
+        while (cursor < last_count && last_floors[cursor].index < i) {
+            cursor++;
+        }
+        if (slot->is_saved && cursor < last_count && last_floors[cursor].index == i && last_floors[cursor].kind == entry->kind) {
+            snapshot->shared = (const uint8_t*)last + last_floors[cursor].offset;
+        }
+        if (entry->kind == SAVE_FLOOR_WHOLE) {
+            is_taken = snapshot_floor(&saver->arena, snapshot, slot->floor);
+        } else if (!snapshot->shared) {
+            uint8_t* copy = arena_alloc(&saver->arena, explored_bytes);
+            if (copy) {
+                memcpy(copy, slot->explored, explored_bytes);
+            }
+            snapshot->copy = copy;
+            is_taken = copy != NULL;
+        }
+        slot->is_saved = true;
+    }
+    SDL_UnlockMutex(dungeon->lock);
+    if (!is_taken) {
+        fprintf(stderr, "Failed to allocate memory to save the game.\n");
+        if (saver->last_map) {
+            // Dirty chunks were cleared for a snapshot that will not be written
+            munmap(saver->last_map, saver->last_bytes);
+            saver->last_map = NULL;
+        }
+        return false;
+    }
+
+    SaveHeader* header = &saver->header;
+    memset(header, 0, sizeof(SaveHeader));
+    memcpy(header->magic, SAVE_MAGIC, sizeof(header->magic));
+    header->seed = game_state->seed;
+    header->file_bytes = offset;
+    header->version = SAVE_VERSION;
+    header->header_bytes = sizeof(SaveHeader);
+    header->floor_bytes = sizeof(SaveFloor);
+    header->floor_count = dungeon->floor_count;
+    header->width = dungeon->width;
+    header->height = dungeon->height;
+    header->saved_floor_count = saved_floor_count;
+    header->current_floor_index = game_state->current_floor_index;
+    header->player_x = game_state->player.x;
+    header->player_y = game_state->player.y;
+    header->fov_mode = game_state->fov_mode;
+
+    SDL_LockMutex(saver->lock);
+    saver->has_work = true;
+    SDL_CondSignal(saver->work_ready);
+    SDL_UnlockMutex(saver->lock);
+    game_state->turns_since_save = 0;
+    return true;
+}
+
+// Saves once autosave_turns moves have been made since the last save. While the last save is
+// still being written it tries again after the next move rather than hold up play.
+void autosave(GameState* game_state) {
+    if (game_state->autosave_turns <= 0 || ++game_state->turns_since_save < game_state->autosave_turns) {
+        return;
+    }
+    Saver* saver = &game_state->saver;
+    if (saver->thread) {
+        SDL_LockMutex(saver->lock);
+        bool is_busy = saver->has_work;
+        SDL_UnlockMutex(saver->lock);
+        if (is_busy) {
+            return;
+        }
+    }
+    save_game(game_state, game_state->save_path ? game_state->save_path : SAVE_PATH);
+}
+
+static bool is_valid_save(const SaveHeader* header, size_t file_bytes) {
+    return memcmp(header->magic, SAVE_MAGIC, sizeof(header->magic)) == 0 && header->version == SAVE_VERSION &&
+           header->header_bytes == sizeof(SaveHeader) && header->floor_bytes == sizeof(SaveFloor) &&
+           header->file_bytes == file_bytes &&
+           header->width >= MIN_GRID_SIZE && header->width <= MAX_GRID_SIZE &&
+           header->height >= MIN_GRID_SIZE && header->height <= MAX_GRID_SIZE &&
+           header->floor_count > 0 && header->current_floor_index >= 0 && header->current_floor_index < header->floor_count &&
+           header->player_x >= 0 && header->player_x < header->width && header->player_y >= 0 && header->player_y < header->height &&
+           (header->fov_mode == FOV_SHADOWCAST || header->fov_mode == FOV_SYMMETRIC) &&
+           header->saved_floor_count >= 0 && header->saved_floor_count <= header->floor_count &&
+           sizeof(SaveHeader) + sizeof(SaveFloor) * (uint64_t)header->saved_floor_count <= file_bytes;
+}
+
+static bool is_valid_save_floor(const SaveFloor* entry, const SaveHeader* header, size_t storage_bytes, size_t explored_bytes) {
+    if (entry->index < 0 || entry->index >= header->floor_count || entry->offset % SAVE_ALIGNMENT != 0 ||
+        entry->bytes != (entry->kind == SAVE_FLOOR_WHOLE ? storage_bytes : explored_bytes) ||
+        (entry->kind != SAVE_FLOOR_WHOLE && entry->kind != SAVE_FLOOR_EXPLORED) ||
+        entry->offset > header->file_bytes || header->file_bytes - entry->offset < entry->bytes) {
+        return false;
+    }
+    if (entry->kind == SAVE_FLOOR_EXPLORED) {
+        return true;
+    }
+    bool is_valid = entry->stairs_up_x >= 0 && entry->stairs_up_x < header->width && entry->stairs_up_y >= 0 && entry->stairs_up_y < header->height &&
+                    entry->stairs_down_x >= 0 && entry->stairs_down_x < header->width && entry->stairs_down_y >= 0 && entry->stairs_down_y < header->height &&
+                    entry->light_count >= 0 && entry->light_count <= MAX_FLOOR_LIGHTS;
+    for (int i = 0; i < entry->light_count && is_valid; i++) {
+        const LightSource* light = &entry->lights[i];
+        is_valid = light->x >= 0 && light->x < header->width && light->y >= 0 && light->y < header->height && light->radius <= MAX_LIGHT_SOURCE_RADIUS;
+    }
+    return is_valid;
+}
+
+// Resumes the game saved in path. The file is mapped copy-on-write and its floors point
+// straight into the mapping, so loading reads only the header and table; tiles are paged in
+// as play touches them, and play never writes back to the file. The header and table are
+// checked, but tile contents are trusted like a chunk file's. The file is also mapped
+// read-only as the last save, which the next save shares unchanged floors with.
+bool load_game(GameState* game_state, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open save %s.\n", path);
+        return false;
+    }
+    struct stat info;
+    void* map = MAP_FAILED;
+    void* shared_map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SaveHeader)) {
+        map = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        shared_map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); // The mappings keep the file
+    const SaveHeader* header = map;
+    bool is_mapped = map != MAP_FAILED && shared_map != MAP_FAILED;
+    if (!is_mapped || !is_valid_save(header, (size_t)info.st_size)) {
+        fprintf(stderr, is_mapped ? "%s is not a save this version can load.\n" : "Could not map save %s.\n", path);
+        if (map != MAP_FAILED) munmap(map, (size_t)info.st_size);
+        if (shared_map != MAP_FAILED) munmap(shared_map, (size_t)info.st_size);
+        return false;
+    }
+
+    Dungeon* dungeon = &game_state->dungeon;
+    const char* chunk_dir = dungeon->chunk_dir;
+    if (!dungeon_init(dungeon, header->floor_count, header->width, header->height, header->seed)) {
+        munmap(map, (size_t)info.st_size);
+        munmap(shared_map, (size_t)info.st_size);
+        return false;
+    }
+    dungeon->chunk_dir = chunk_dir;
+    dungeon->save_map = map; // Released with the dungeon from here on
+    dungeon->save_bytes = (size_t)info.st_size;
+    Saver* saver = &game_state->saver;
+    finish_save(saver);
+    if (saver->last_map) {
+        munmap(saver->last_map, saver->last_bytes);
+    }
+    saver->last_map = shared_map; // And this with the saver
+    saver->last_bytes = (size_t)info.st_size;
+
+    size_t storage_bytes = floor_storage_bytes(header->width, header->height);
+    size_t explored_bytes = plane_words(header->width, header->height) * sizeof(uint64_t);
+    const SaveFloor* entries = (const SaveFloor*)(header + 1);
+    bool is_valid = true;
+    SDL_LockMutex(dungeon->lock);
+    for (int n = 0; n < header->saved_floor_count && is_valid; n++) {
+        const SaveFloor* entry = &entries[n];
+        is_valid = is_valid_save_floor(entry, header, storage_bytes, explored_bytes) && reserve_slots(dungeon, entry->index) &&
+                   !dungeon->slots[entry->index].floor && !dungeon->slots[entry->index].explored;
+        if (!is_valid) break;
+        uint8_t* section = (uint8_t*)map + entry->offset;
+        FloorSlot* slot = &dungeon->slots[entry->index];
+        slot->is_saved = true;
+        if (entry->kind == SAVE_FLOOR_EXPLORED) {
+            slot->explored = (uint64_t*)section;
+            continue;
+        }
+        Floor* floor = arena_alloc(&dungeon->arena, floor_header_bytes(dungeon));
+        if (!floor) {
+            is_valid = false;
+            break;
+        }
+        floor_layout(floor, header->width, header->height, -1);
+        floor_attach(floor, section);
+        attach_dirty_chunks(floor);
+        floor->is_save_view = true;
+        floor->stairs_up = (SDL_Point){ entry->stairs_up_x, entry->stairs_up_y };
+        floor->stairs_down = (SDL_Point){ entry->stairs_down_x, entry->stairs_down_y };
+        floor->revision = entry->revision;
+        floor->light_count = entry->light_count;
+        memcpy(floor->lights, entry->lights, sizeof(LightSource) * entry->light_count);
+        slot->floor = floor;
+        dungeon->resident_count++;
+    }
+    SDL_UnlockMutex(dungeon->lock);
+    if (!is_valid) {
+        fprintf(stderr, "The floors in save %s are damaged.\n", path);
+        return false;
+    }
+
+    game_state->seed = header->seed;
+    game_state->current_floor_index = header->current_floor_index;
+    game_state->player.x = header->player_x;
+    game_state->player.y = header->player_y;
+    game_state->fov_mode = (FovMode)header->fov_mode;
+    return true;
+}
+
+
+// --- Replay Functions ---
+
+// Folds the player's floor, position and sight mode into trace, along with value
+static uint64_t trace_state(uint64_t trace, const GameState* game_state, uint64_t value) {
+    uint64_t words[] = { (uint64_t)game_state->current_floor_index, (uint64_t)game_state->player.x,
+                         (uint64_t)game_state->player.y, (uint64_t)game_state->fov_mode, value };
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        trace = (trace ^ words[i]) * 0x100000001b3ULL; // FNV-1a, a word at a time
+    }
+    return trace;
+}
+
+// Writes the run of commands being recorded as one byte
+static void write_run(Recorder* recorder) {
+    if (recorder->run_length > 0) {
+        fputc(recorder->run_command | (recorder->run_length - 1) << 4, recorder->file);
+        recorder->run_length = 0;
+    }
+}
+
+// Starts recording the commands applied to the game just set up to a replay at path.
+// Replays start from a new game, built from the seed and dungeon size in their header.
+bool start_recording(GameState* game_state, const char* path) {
+    if (game_state->load_path) {
+        fprintf(stderr, "Replays start from a new game; --record cannot be used with --load.\n");
+        return false;
+    }
+    Recorder* recorder = &game_state->recorder;
+    recorder->file = fopen(path, "wb");
+    if (!recorder->file) {
+        fprintf(stderr, "Could not create replay %s.\n", path);
+        return false;
+    }
+
+    ReplayHeader* header = &recorder->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, REPLAY_MAGIC, sizeof(header->magic));
+    header->seed = game_state->seed;
+    header->version = REPLAY_VERSION;
+    header->floor_count = game_state->dungeon.floor_count;
+    header->width = game_state->dungeon.width;
+    header->height = game_state->dungeon.height;
+    header->command_count = -1;
+    recorder->run_length = 0;
+    recorder->command_count = 0;
+    recorder->trace = 0;
+    if (fwrite(header, sizeof(*header), 1, recorder->file) != 1) {
+        fprintf(stderr, "Could not write replay %s.\n", path);
+        fclose(recorder->file);
+        recorder->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Folds the state command is about to be applied to into the game's trace and, while
+// recording, adds command to the replay. Saves leave the game as it is and are left out.
+void record_command(GameState* game_state, Command command) {
+    if (command == COMMAND_NONE || command == COMMAND_SAVE) {
+        return;
+    }
+    Recorder* recorder = &game_state->recorder;
+    recorder->trace = trace_state(recorder->trace, game_state, command);
+    recorder->command_count++;
+    if (!recorder->file) {
+        return;
+    }
+    if (recorder->run_length == REPLAY_MAX_RUN || (recorder->run_length > 0 && recorder->run_command != command)) {
+        write_run(recorder);
+    }
+    recorder->run_command = command;
+    recorder->run_length++;
+}
+
+// Trace of the game so far: every command and the state it was applied to, then the state now
+uint64_t replay_trace(const GameState* game_state) {
+    return trace_state(game_state->recorder.trace, game_state, (uint64_t)game_state->recorder.command_count);
+}
+
+// Writes the last run and the header, now the commands and trace are known, and closes the replay
+bool finish_recording(GameState* game_state) {
+    Recorder* recorder = &game_state->recorder;
+    if (!recorder->file) {
+        return true;
+    }
+    write_run(recorder);
+    recorder->header.command_count = recorder->command_count;
+    recorder->header.trace = replay_trace(game_state);
+    bool is_written = !ferror(recorder->file) && fseek(recorder->file, 0, SEEK_SET) == 0 &&
+                      fwrite(&recorder->header, sizeof(recorder->header), 1, recorder->file) == 1;
+    if (fclose(recorder->file) != 0) {
+        is_written = false;
+    }
+    recorder->file = NULL;
+    if (!is_written) {
+        fprintf(stderr, "Could not finish writing the replay.\n");
+    }
+    return is_written;
+}
+
+// Reads the replay in file and sets game_state up to play it with the seed and dungeon size
+// it was recorded with. Returns its commands, or NULL if it cannot be played.
+Command* read_replay(FILE* file, const char* path, GameState* game_state, ReplayHeader* header, long* command_count) {
+    if (fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, REPLAY_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%s is not a replay.\n", path);
+        return NULL;
+    }
+    if (header->version != REPLAY_VERSION) {
+        fprintf(stderr, "Replay %s is version %u; this build plays version %d.\n", path, header->version, REPLAY_VERSION);
+        return NULL;
+    }
+    if (header->floor_count <= 0 || header->width < MIN_GRID_SIZE || header->height < MIN_GRID_SIZE ||
+        header->width > MAX_GRID_SIZE || header->height > MAX_GRID_SIZE) {
+        fprintf(stderr, "Replay %s is damaged.\n", path);
+        return NULL;
+    }
+    if (game_state->load_path) {
+        fprintf(stderr, "Replays start from a new game; a replay cannot be played with --load.\n");
+        return NULL;
+    }
+
+    Command* commands = NULL;
+    long count = 0, capacity = 0;
+    bool is_damaged = false;
+    bool is_valid = true;
+    int c;
+    while ((c = fgetc(file)) != EOF && is_valid) {
+        Command command = (Command)(c & 15);
+        is_damaged = command == COMMAND_NONE || command == COMMAND_SAVE || command > COMMAND_QUIT;
+        is_valid = !is_damaged && push_commands(&commands, &count, &capacity, command, (c >> 4) + 1);
+    }
+    if (is_valid) {
+        is_damaged = header->command_count >= 0 && header->command_count != count; // Cut short
+    }
+    if (is_damaged || !is_valid || count == 0) {
+        if (is_damaged) {
+            fprintf(stderr, "Replay %s is damaged.\n", path);
+        } else if (is_valid) {
+            fprintf(stderr, "Replay %s has no commands.\n", path);
+        }
+        free(commands);
+        return NULL;
+    }
+
+    game_state->seed = header->seed;
+    game_state->dungeon.floor_count = header->floor_count;
+    game_state->dungeon.width = header->width;
+    game_state->dungeon.height = header->height;
+    *command_count = count;
+    return commands;
+}
+
+// Compares the game played from a replay with the game it was recorded from. They differ
+// when a build changes what the same commands do.
+bool check_replay(const GameState* game_state, const ReplayHeader* header) {
+    if (header->command_count < 0) {
+        printf("Replay was never finished, so there is no recorded trace to compare\n");
+        return true;
+    }
+    uint64_t trace = replay_trace(game_state);
+    if (trace != header->trace) {
+        printf("Replay diverged from its recording: trace %016" PRIx64 ", recorded %016" PRIx64 "\n", trace, header->trace);
+        return false;
+    }
+    printf("Replay matches its recording: trace %016" PRIx64 "\n", trace);
+    return true;
+}
+
+// --- Dungeon Generation Functions ---
+
+typedef struct {
+    Floor* floors;
+    uint64_t seed;
+} DungeonBatch;
+
+static void generate_floor_job(void* data, int index) {
+    DungeonBatch* batch = data;
+    Rng rng = floor_rng(batch->seed, index);
+    generate_floor(&batch->floors[index], &rng);
+}
+
+// Builds every floor from its own stream of the master seed, one floor per job. Floors share
+// no state, so the result is the same whichever thread builds which floor. The floors must
+// already have been through floor_init().
+void generate_dungeon(ThreadPool* pool, Floor* floors, int floor_count, uint64_t seed) {
+    DungeonBatch batch = { floors, seed };
+    thread_pool_run(pool, generate_floor_job, &batch, floor_count);
+}
+
+// Fills floor with rooms, corridors, lakes and lights. Working buffers come from the calling
+// thread's scratch arena, which is reset before returning. Returns false if it cannot grow.
+bool generate_floor(Floor* floor, Rng* rng) {
+    Arena* scratch = scratch_arena();
+    floor->revision++;
+    memset(floor->types, TILE_WALL, (size_t)CHUNK_TILES * floor->chunk_count);
+    memset(floor->opaque, 0xFF, plane_bytes(floor));
+    memset(floor->passable, 0, plane_bytes(floor));
+    memset(floor->visible, 0, plane_bytes(floor));
+    memset(floor->explored, 0, plane_bytes(floor));
+
+    // Room attempts grow with the floor's area so large floors are as densely filled
+    int attempts = (int)((long long)MAX_ROOMS * floor->width * floor->height / (GRID_COLS * GRID_ROWS));
+    if (attempts < 1) attempts = 1;
+    SDL_Rect* rooms = arena_alloc(scratch, sizeof(SDL_Rect) * attempts);
+    if (!rooms) {
+        fprintf(stderr, "Failed to allocate memory for the room list.\n");
+        return false;
+    }
+    int room_count = 0;
+
+    for (int i = 0; i < attempts; ++i) {
+        int w = MIN_ROOM_W + rng_range(rng, MAX_ROOM_W - MIN_ROOM_W + 1);
+        int h = MIN_ROOM_H + rng_range(rng, MAX_ROOM_H - MIN_ROOM_H + 1);
+        int x = rng_range(rng, floor->width - w - 1) + 1;
+        int y = rng_range(rng, floor->height - h - 1) + 1;
+
+        SDL_Rect new_room = {x, y, w, h};
+        bool failed = false;
+        for (int j = 0; j < room_count; ++j) {
+            if (SDL_HasIntersection(&new_room, &rooms[j])) {
+                failed = true;
+                break;
+            }
+        }
+
+        if (!failed) {
+            carve_room(floor, new_room);
+            if (room_count > 0) {
+                SDL_Point new_center = {x + w / 2, y + h / 2};
+                SDL_Point prev_center = {rooms[room_count - 1].x + rooms[room_count - 1].w / 2, rooms[room_count - 1].y + rooms[room_count - 1].h / 2};
+                if (rng_range(rng, 2) == 0) {
+                    carve_h_corridor(floor, prev_center.x, new_center.x, prev_center.y);
+                    carve_v_corridor(floor, prev_center.y, new_center.y, new_center.x);
+                } else {
+                    carve_v_corridor(floor, prev_center.y, new_center.y, prev_center.x);
+                    carve_h_corridor(floor, prev_center.x, new_center.x, new_center.y);
+                }
+            }
+            rooms[room_count++] = new_room;
+        }
+    }
+    
+    // Generate and apply lakes before placing stairs
+    if (!generate_lakes(floor, rng)) {
+        arena_reset(scratch);
+        return false;
+    }
+
+    floor->stairs_up = (SDL_Point){rooms[0].x + rooms[0].w / 2, rooms[0].y + rooms[0].h / 2};
+    set_tile_type(floor, floor->stairs_up.x, floor->stairs_up.y, TILE_STAIRS_UP);
+    
+    floor->stairs_down = (SDL_Point){rooms[room_count - 1].x + rooms[room_count - 1].w / 2, rooms[room_count - 1].y + rooms[room_count - 1].h / 2};
+    set_tile_type(floor, floor->stairs_down.x, floor->stairs_down.y, TILE_STAIRS_DOWN);
+
+    // Light sources: stair beacons, a torch per room and the odd glowing pool. A floor holds
+    // MAX_FLOOR_LIGHTS, so when more are due the torches and pools are thinned evenly over
+    // the floor, rather than letting the first rooms take every slot.
+    floor->light_count = 0;
+    add_light(floor, floor->stairs_up.x, floor->stairs_up.y, 5, 220, 120, 60);
+    add_light(floor, floor->stairs_down.x, floor->stairs_down.y, 5, 60, 120, 220);
+    long water_count = 0;
+    for (int y = 0; y < floor->height; ++y) {
+        for (int x = 0; x < floor->width; ++x) {
+            water_count += get_tile_type(floor, x, y) == TILE_WATER;
+        }
+    }
+    long due = room_count + water_count / 16;
+    long slots = MAX_FLOOR_LIGHTS - floor->light_count;
+    bool is_thinned = due > slots;
+    long torch_count = is_thinned ? room_count * slots / due : room_count;
+    long pool_slots = slots - torch_count;
+    long water_left = water_count;
+    for (int i = 0; i < room_count; ++i) {
+        if ((long)i * torch_count / room_count != (long)(i + 1) * torch_count / room_count) {
+            add_light(floor, rooms[i].x + rng_range(rng, rooms[i].w), rooms[i].y + rng_range(rng, rooms[i].h), 7, 255, 170, 90);
+        }
+    }
+    for (int y = 0; y < floor->height; ++y) {
+        for (int x = 0; x < floor->width; ++x) {
+            if (get_tile_type(floor, x, y) != TILE_WATER) continue;
+            if (!is_thinned) {
+                if (rng_range(rng, 16) == 0) {
+                    add_light(floor, x, y, 3, 40, 110, 160);
+                }
+                continue;
+            }
+            // Selection sampling: exactly pool_slots pools, each water tile equally likely
+            if (rng_range(rng, (int)water_left) < pool_slots) {
+                add_light(floor, x, y, 3, 40, 110, 160);
+                pool_slots--;
+            }
+            water_left--;
+        }
+    }
+    arena_reset(scratch);
+    return true;
+}
+
+// Columns past width in each row's last word; kept set so they read as solid edge
+#define CA_PADDING(width) ((width) % 64 ? ~0ULL << ((width) % 64) : 0ULL)
+
+// One automaton step on packed rows, 64 cells at a time. A cell lives on with 4 or more
+// live neighbours and is born with 5 or more, which is the same as 5 or more live cells
+// in its 3x3 block counting itself. Cells off the map count as alive.
+void ca_step(const uint64_t* old_map, uint64_t* new_map, int width, int height) {
+    int stride = (width + 63) / 64;
+    for (int y = 0; y < height; y++) {
+        // A row's words are CHUNK_SIZE apart, one per chunk
+        const uint64_t* rows[3] = {
+            y > 0 ? &old_map[plane_word(stride, 0, y - 1)] : NULL,
+            &old_map[plane_word(stride, 0, y)],
+            y < height - 1 ? &old_map[plane_word(stride, 0, y + 1)] : NULL
+        };
+        uint64_t* out = &new_map[plane_word(stride, 0, y)];
+        for (int w = 0; w < stride; w++) {
+            // Each row's west, centre and east bits summed into a two-bit count (carry, sum)
+            uint64_t sum[3], carry[3];
+            for (int r = 0; r < 3; r++) {
+                uint64_t centre = ~0ULL, west = ~0ULL, east = ~0ULL;
+                if (rows[r]) {
+                    uint64_t before = w > 0 ? rows[r][(w - 1) * CHUNK_SIZE] : ~0ULL;
+                    uint64_t after = w < stride - 1 ? rows[r][(w + 1) * CHUNK_SIZE] : ~0ULL;
+                    centre = rows[r][w * CHUNK_SIZE];
+                    west = (centre << 1) | (before >> 63);
+                    east = (centre >> 1) | (after << 63);
+                }
+                sum[r] = west ^ centre ^ east;
+                carry[r] = (west & centre) | (east & (west ^ centre));
+            }
+
+            // Add the three rows: ones + 2 * twos + 4 * fours + 8 * eights
+            uint64_t ones = sum[0] ^ sum[1] ^ sum[2];
+            uint64_t twos_a = (sum[0] & sum[1]) | (sum[2] & (sum[0] ^ sum[1]));
+            uint64_t twos_b = carry[0] ^ carry[1] ^ carry[2];
+            uint64_t fours_a = (carry[0] & carry[1]) | (carry[2] & (carry[0] ^ carry[1]));
+            uint64_t twos = twos_a ^ twos_b;
+            uint64_t fours_b = twos_a & twos_b;
+            uint64_t fours = fours_a ^ fours_b;
+            uint64_t eights = fours_a & fours_b;
+
+            out[w * CHUNK_SIZE] = eights | (fours & (twos | ones));
+        }
+        out[(stride - 1) * CHUNK_SIZE] |= CA_PADDING(width);
+    }
+}
+
+// Grows lakes with the automaton over the whole floor. The two automaton buffers are as
+// large as a bit plane and come from the thread's scratch arena, left for the caller to reset;
+// returns false if they cannot be had.
+bool generate_lakes(Floor* floor, Rng* rng) {
+    uint64_t* ca_map1 = arena_alloc(scratch_arena(), plane_bytes(floor));
+    uint64_t* ca_map2 = arena_alloc(scratch_arena(), plane_bytes(floor));
+    if (!ca_map1 || !ca_map2) {
+        fprintf(stderr, "Failed to allocate memory for the lake automaton.\n");
+        return false;
+    }
+    memset(ca_map1, 0, plane_bytes(floor));
+    uint64_t* current = ca_map1;
+    uint64_t* next = ca_map2;
+
+    // Seed the initial map
+    for (int y = 0; y < floor->height; y++) {
+        for (int x = 0; x < floor->width; x++) {
+            plane_set(current, floor->stride, x, y, rng_range(rng, 100) < CA_CHANCE_TO_START_ALIVE);
+        }
+        current[plane_word(floor->stride, floor->stride - 1, y)] |= CA_PADDING(floor->width);
+    }
+
+    // Run the simulation
+    for (int i = 0; i < CA_SIMULATION_STEPS; i++) {
+        ca_step(current, next, floor->width, floor->height);
+        uint64_t* swap = current;
+        current = next;
+        next = swap;
+    }
+
+    // Apply the final blob map to the floor
+    for (int y = 0; y < floor->height; y++) {
+        for (int x = 0; x < floor->width; x++) {
+            if (plane_get(current, floor->stride, x, y) && get_tile_type(floor, x, y) == TILE_GROUND) {
+                set_tile_type(floor, x, y, TILE_WATER);
+            }
+        }
+    }
+    return true;
+}
+
+
+void carve_room(Floor* floor, SDL_Rect room) {
+    for (int y = room.y; y < room.y + room.h; ++y) {
+        for (int x = room.x; x < room.x + room.w; ++x) {
+            set_tile_type(floor, x, y, TILE_GROUND);
+        }
     }
 }
 
 void carve_h_corridor(Floor* floor, int x1, int x2, int y) {
     for (int x = (x1 < x2 ? x1 : x2); x <= (x1 > x2 ? x1 : x2); ++x) {
-        floor->tiles[y][x].type = TILE_GROUND;
+        set_tile_type(floor, x, y, TILE_GROUND);
+    }
+}
+
+void carve_v_corridor(Floor* floor, int y1, int y2, int x) {
+    for (int y = (y1 < y2 ? y1 : y2); y <= (y1 > y2 ? y1 : y2); ++y) {
+        set_tile_type(floor, x, y, TILE_GROUND);
+    }
+}
+
+void set_tile_type(Floor* floor, int x, int y, TileType type) {
+    uint8_t* tile = &floor->types[chunk_tile(floor->stride, x, y)];
+    if (*tile != type) {
+        floor->revision++;
+        floor->chunks[chunk_index(floor->stride, x, y)].revision++;
+        mark_chunks_dirty(floor, x, y, x, y);
+    }
+    *tile = (uint8_t)type;
+    plane_set(floor->opaque, floor->stride, x, y, type == TILE_WALL);
+    plane_set(floor->passable, floor->stride, x, y, type != TILE_WALL);
+}
+
+// --- Field of View Functions ---
+
+// Shadowcasting work is kept on an explicit stack instead of the call stack, so
+// large maps cannot overflow it. Slopes are exact fractions (num / den, den > 0)
+// and never touch floating point.
+typedef struct {
+    int row;
+    int start_num, start_den;
+    int end_num, end_den;
+} FovSpan;
+
+typedef struct {
+    FovSpan* spans;
+    int count;
+    int capacity;
+} FovStack;
+
+static _Thread_local FovStack fov_stack;
+
+static bool fov_push(int row, int start_num, int start_den, int end_num, int end_den) {
+    if (fov_stack.count == fov_stack.capacity) {
+        int capacity = fov_stack.capacity ? fov_stack.capacity * 2 : 64;
+        FovSpan* spans = realloc(fov_stack.spans, sizeof(FovSpan) * capacity);
+        if (!spans) {
+            fprintf(stderr, "Failed to grow the field of view stack.\n");
+            return false;
+        }
+        fov_stack.spans = spans;
+        fov_stack.capacity = capacity;
+    }
+    fov_stack.spans[fov_stack.count++] = (FovSpan){ row, start_num, start_den, end_num, end_den };
+    return true;
+}
+
+// Each thread has its own span stack; threads that cast FOV free theirs before exiting
+void release_fov_stack(void) {
+    free(fov_stack.spans);
+    fov_stack = (FovStack){0};
+}
+
+// light_extents[r][dx] is the furthest dy still inside a circle of radius r,
+// so radius-limited casting never needs per-tile distance math
+static uint8_t light_extents[MAX_LIGHT_RADIUS + 1][MAX_LIGHT_RADIUS + 1];
+
+void init_light_tables(void) {
+    for (int r = 1; r <= MAX_LIGHT_RADIUS; r++) {
+        int dy = r;
+        for (int dx = 0; dx <= r; dx++) {
+            // r * (r + 1) rounds the circle out so it has no single-tile nubs
+            while (dx * dx + dy * dy > r * (r + 1)) {
+                dy--;
+            }
+            light_extents[r][dx] = (uint8_t)dy;
+        }
+    }
+}
+
+// Rounds depth * num / den half away from zero, the same way roundf() did.
+static int fov_round(int depth, int num, int den) {
+    long long twice = 2LL * depth * num;
+    if (twice >= 0) {
+        return (int)((twice + den) / (2LL * den));
+    }
+    return -(int)((-twice + den) / (2LL * den));
+}
+
+FovMap floor_fov_map(Floor* floor) {
+    return (FovMap){ floor->width, floor->height, floor->stride, floor->opaque, floor->visible, floor->explored };
+}
+
+// Clears only the words under the last lit area, so the cost follows the visible area
+void clear_visible_area(const FovMap* map, VisibleArea* area) {
+    if (area->max_x >= area->min_x) {
+        int first_word = area->min_x >> 6;
+        int word_count = (area->max_x >> 6) - first_word + 1;
+        for (int y = area->min_y; y <= area->max_y; y++) {
+            for (int w = first_word; w < first_word + word_count; w++) {
+                map->visible[plane_word(map->stride, w, y)] = 0;
+            }
+        }
+    }
+    area->min_x = area->min_y = INT_MAX;
+    area->max_x = area->max_y = -1;
+}
+
+void update_fov(GameState* game_state, int radius) {
+    Floor* floor = dungeon_floor(&game_state->dungeon, game_state->current_floor_index);
+    if (!floor) {
+        return;
+    }
+    FovMap map = floor_fov_map(floor);
+    VisibleArea* area = &game_state->visible_area;
+    int px = game_state->player.x;
+    int py = game_state->player.y;
+    floor_page(floor, px, py);
+
+    if (area->floor_index == game_state->current_floor_index) {
+        clear_visible_area(&map, area);
+    } else {
+        // New floor: drop the old one's lit tiles and sweep this one once. Chunk files are
+        // skipped, as sweeping would fault in every chunk; they are only lit through here.
+        // So are floors from a save, which are saved with nothing lit.
+        Floor* old_floor = area->floor_index >= 0 ? dungeon_floor(&game_state->dungeon, area->floor_index) : NULL;
+        if (old_floor) {
+            FovMap old_map = floor_fov_map(old_floor);
+            clear_visible_area(&old_map, area);
+        }
+        if (!floor->is_file_backed && !floor->is_save_view) {
+            memset(floor->visible, 0, plane_bytes(floor));
+        }
+        area->floor_index = game_state->current_floor_index;
+    }
+
+    bool hit = false;
+    FovCacheEntry* entry = fov_cache_lookup(&game_state->fov_cache, game_state->current_floor_index, px, py, radius, game_state->fov_mode, floor->revision, &hit);
+
+    if (hit) {
+        // Seen from here before: copy the stored words back instead of casting
+        area->min_x = entry->area.min_x;
+        area->max_x = entry->area.max_x;
+        area->min_y = entry->area.min_y;
+        area->max_y = entry->area.max_y;
+        const uint64_t* words = entry->visible;
+        for (int y = area->min_y; y <= area->max_y; y++) {
+            for (int w = area->min_x >> 6; w <= area->max_x >> 6; w++, words++) {
+                floor->visible[plane_word(floor->stride, w, y)] = *words;
+                floor->explored[plane_word(floor->stride, w, y)] |= *words;
+            }
+        }
+        mark_chunks_dirty(floor, area->min_x, area->min_y, area->max_x, area->max_y);
+        return;
+    }
+
+    bool is_complete = compute_fov(&map, px, py, radius, game_state->fov_mode, area) >= 0;
+    mark_chunks_dirty(floor, area->min_x, area->min_y, area->max_x, area->max_y);
+    if (!is_complete) {
+        // Out of memory: what the player sees is wrong, so it is neither kept nor played on
+        fprintf(stderr, "Could not finish the field of view; stopping.\n");
+        game_state->is_running = false;
+        if (entry) {
+            entry->area.floor_index = -1;
+        }
+        return;
+    }
+
+    if (entry) {
+        entry->area = *area;
+        uint64_t* words = entry->visible;
+        for (int y = area->min_y; y <= area->max_y; y++) {
+            for (int w = area->min_x >> 6; w <= area->max_x >> 6; w++, words++) {
+                *words = floor->visible[plane_word(floor->stride, w, y)];
+            }
+        }
+    }
+}
+
+bool fov_cache_init(FovCache* cache, int entry_count) {
+    *cache = (FovCache){0};
+    if (entry_count == 0) {
+        return true;
+    }
+    cache->entries = malloc(sizeof(FovCacheEntry) * entry_count);
+    if (!cache->entries) {
+        return false;
+    }
+    for (int i = 0; i < entry_count; i++) {
+        cache->entries[i].area.floor_index = -1;
+        cache->entries[i].last_used = 0;
+    }
+    cache->entry_count = entry_count;
+    return true;
+}
+
+void fov_cache_free(FovCache* cache) {
+    free(cache->entries);
+    *cache = (FovCache){0};
+}
+
+// Finds the pass for this viewer and sets hit when it is still valid. On a miss the
+// returned entry (the stale one for this key, else the least recently used) has been
+// claimed for the caller to fill in. Returns NULL when the cache is disabled or the
+// radius is unlimited or wider than PLAYER_SIGHT_RADIUS, as entries have no room for it.
+FovCacheEntry* fov_cache_lookup(FovCache* cache, int floor_index, int x, int y, int radius, FovMode mode, uint32_t revision, bool* hit) {
+    *hit = false;
+    if (cache->entry_count == 0 || radius <= 0 || radius > PLAYER_SIGHT_RADIUS) {
+        return NULL;
+    }
+
+    FovCacheEntry* victim = &cache->entries[0];
+    for (int i = 0; i < cache->entry_count; i++) {
+        FovCacheEntry* entry = &cache->entries[i];
+        if (entry->area.floor_index == floor_index && entry->x == x && entry->y == y && entry->radius == radius && entry->mode == mode) {
+            victim = entry;
+            *hit = entry->revision == revision;
+            break;
+        }
+        if (entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    victim->last_used = ++cache->clock;
+    if (*hit) {
+        cache->hits++;
+        return victim;
+    }
+
+    cache->misses++;
+    victim->area.floor_index = floor_index;
+    victim->x = x;
+    victim->y = y;
+    victim->radius = radius;
+    victim->mode = mode;
+    victim->revision = revision;
+    return victim;
+}
+
+// Lights the visible plane out to radius (0 for unlimited, capped at MAX_LIGHT_RADIUS)
+// and grows area to cover every tile lit. Returns the tiles scanned, or -1 if an octant
+// ran out of memory and the result is incomplete.
+int compute_fov(const FovMap* map, int origin_x, int origin_y, int radius, FovMode mode, VisibleArea* area) {
+    if (radius > MAX_LIGHT_RADIUS) {
+        radius = MAX_LIGHT_RADIUS;
+    }
+
+    plane_set(map->visible, map->stride, origin_x, origin_y, true);
+    if (origin_x < area->min_x) area->min_x = origin_x;
+    if (origin_x > area->max_x) area->max_x = origin_x;
+    if (origin_y < area->min_y) area->min_y = origin_y;
+    if (origin_y > area->max_y) area->max_y = origin_y;
+
+    int scanned = 1;
+    bool is_complete = true;
+    for (int i = 0; i < 8; i++) {
+        int octant_scanned = mode == FOV_SYMMETRIC ? cast_symmetric(map, origin_x, origin_y, radius, i, area)
+                                                   : cast_light(map, origin_x, origin_y, radius, i, area);
+        if (octant_scanned < 0) {
+            is_complete = false;
+        } else {
+            scanned += octant_scanned;
+        }
+    }
+
+    // Everything visible is now explored, a word at a time
+    for (int y = area->min_y; map->explored && y <= area->max_y; y++) {
+        for (int w = area->min_x >> 6; w <= area->max_x >> 6; w++) {
+            size_t word = plane_word(map->stride, w, y);
+            map->explored[word] |= map->visible[word];
+        }
+    }
+    return is_complete ? scanned : -1;
+}
+
+// Maps an octant offset (dx along its main axis, dy across it) onto the map:
+// x = origin_x + dx * xx + dy * xy, y = origin_y + dx * yx + dy * yy
+static const int octant_transforms[8][4] = {
+    //  xx  xy  yx  yy
+    {  0,  1, -1,  0 },
+    {  1,  0,  0, -1 },
+    {  1,  0,  0,  1 },
+    {  0,  1,  1,  0 },
+    {  0, -1,  1,  0 },
+    { -1,  0,  0,  1 },
+    { -1,  0,  0, -1 },
+    {  0, -1, -1,  0 },
+};
+
+// Where one octant's rows fall on the map, worked out once per octant
+typedef struct {
+    int xx, xy, yx, yy;
+    int max_row;                     // Last row inside both the map and the radius
+    int dy_limit_low, dy_limit_high; // Offsets across the main axis that stay on the map
+    const uint8_t* extents;          // Circle extents for the radius, NULL when unlimited
+} OctantScan;
+
+static OctantScan begin_octant_scan(const FovMap* map, int origin_x, int origin_y, int radius, int octant) {
+    OctantScan scan = { octant_transforms[octant][0], octant_transforms[octant][1], octant_transforms[octant][2], octant_transforms[octant][3], 0, 0, 0, NULL };
+
+    // How far the map reaches along the main axis, and either way across it.
+    // Clamping to these up front keeps bounds checks out of the tile loop.
+    if (scan.xx != 0) {
+        scan.max_row = scan.xx > 0 ? map->width - 1 - origin_x : origin_x;
+        scan.dy_limit_high = scan.yy > 0 ? map->height - 1 - origin_y : origin_y;
+        scan.dy_limit_low = scan.yy > 0 ? -origin_y : origin_y - (map->height - 1);
+    } else {
+        scan.max_row = scan.yx > 0 ? map->height - 1 - origin_y : origin_y;
+        scan.dy_limit_high = scan.xy > 0 ? map->width - 1 - origin_x : origin_x;
+        scan.dy_limit_low = scan.xy > 0 ? -origin_x : origin_x - (map->width - 1);
+    }
+
+    // Outside the light radius nothing is lit either
+    if (radius > 0) {
+        scan.extents = light_extents[radius];
+        if (scan.max_row > radius) {
+            scan.max_row = radius;
+        }
+    }
+    return scan;
+}
+
+// Lights one octant and returns the tiles scanned, or -1 if the span stack could not
+// grow; the octant is then only partly lit, though area still covers what was
+int cast_light(const FovMap* map, int origin_x, int origin_y, int radius, int octant, VisibleArea* area) {
+    const OctantScan scan = begin_octant_scan(map, origin_x, origin_y, radius, octant);
+    const int xx = scan.xx, xy = scan.xy, yx = scan.yx, yy = scan.yy;
+
+    int min_x = area->min_x, max_x = area->max_x;
+    int min_y = area->min_y, max_y = area->max_y;
+    int scanned = 0;
+    bool is_complete = true;
+    fov_stack.count = 0;
+    if (!fov_push(1, 1, 1, 0, 1)) {
+        return -1;
+    }
+
+    while (fov_stack.count > 0) {
+        FovSpan span = fov_stack.spans[--fov_stack.count];
+
+        if ((long long)span.start_num * span.end_den < (long long)span.end_num * span.start_den) {
+            continue;
+        }
+
+        for (int dx = span.row; dx <= scan.max_row; dx++) {
+            int next_start_num = span.start_num;
+            int next_start_den = span.start_den;
+            int min_dy = fov_round(dx, span.end_num, span.end_den);
+            int max_dy = fov_round(dx, span.start_num, span.start_den);
+            if (scan.extents && max_dy > scan.extents[dx]) {
+                max_dy = scan.extents[dx];
+            }
+            if (max_dy > scan.dy_limit_high) max_dy = scan.dy_limit_high;
+            if (min_dy < scan.dy_limit_low) min_dy = scan.dy_limit_low;
+            if (max_dy < min_dy) {
+                continue;
+            }
+
+            // The row is one straight run of tiles, so its ends bound it
+            int x = origin_x + dx * xx + max_dy * xy;
+            int y = origin_y + dx * yx + max_dy * yy;
+            int end_x = x - (max_dy - min_dy) * xy;
+            int end_y = y - (max_dy - min_dy) * yy;
+            if ((x < end_x ? x : end_x) < min_x) min_x = x < end_x ? x : end_x;
+            if ((x > end_x ? x : end_x) > max_x) max_x = x > end_x ? x : end_x;
+            if ((y < end_y ? y : end_y) < min_y) min_y = y < end_y ? y : end_y;
+            if ((y > end_y ? y : end_y) > max_y) max_y = y > end_y ? y : end_y;
+            scanned += max_dy - min_dy + 1;
+
+            bool blocked = false;
+            if (xy != 0) {
+                // The row lies along one map row, so light it and find its wall runs a word
+                // at a time. Scanning runs from x (max_dy) to end_x (min_dy).
+                plane_fill(map->visible, map->stride, x < end_x ? x : end_x, x > end_x ? x : end_x, y);
+                int step = -xy;
+                int at = x;
+                for (;;) {
+                    int wall_x = plane_find(map->opaque, map->stride, at, end_x, step, y, true);
+                    if (wall_x == end_x + step) {
+                        break;
+                    }
+                    // Light above this wall run carries on in its own span
+                    int dy = (wall_x - origin_x) * xy;
+                    if (!fov_push(dx + 1, span.start_num, span.start_den, 2 * dy + 1, 2 * dx - 1)) {
+                        is_complete = false;
+                        break;
+                    }
+                    int open_x = plane_find(map->opaque, map->stride, wall_x, end_x, step, y, false);
+                    if (open_x == end_x + step) {
+                        blocked = true;
+                        break;
+                    }
+                    // Past the run the span narrows to the run's last wall
+                    span.start_num = 2 * (open_x - origin_x) * xy + 1;
+                    span.start_den = 2 * dx + 1;
+                    at = open_x;
+                }
+                if (blocked || !is_complete) {
+                    break;
+                }
+                continue;
+            }
+            for (int dy = max_dy; dy >= min_dy; dy--, x -= xy, y -= yy) {
+                size_t word = plane_word(map->stride, x >> 6, y);
+                uint64_t bit = (uint64_t)1 << (x & 63);
+                map->visible[word] |= bit;
+
+                if (map->opaque[word] & bit) {
+                    if (!blocked) {
+                        // Light above this wall run carries on in its own span
+                        if (!fov_push(dx + 1, span.start_num, span.start_den, 2 * dy + 1, 2 * dx - 1)) {
+                            is_complete = false;
+                            break;
+                        }
+                        blocked = true;
+                    }
+                    next_start_num = 2 * dy - 1;
+                    next_start_den = 2 * dx + 1;
+                } else if (blocked) {
+                    span.start_num = next_start_num;
+                    span.start_den = next_start_den;
+                    blocked = false;
+                }
+            }
+
+            if (blocked || !is_complete) {
+                break;
+            }
+        }
+        if (!is_complete) {
+            break;
+        }
+    }
+
+    area->min_x = min_x;
+    area->max_x = max_x;
+    area->min_y = min_y;
+    area->max_y = max_y;
+    return is_complete ? scanned : -1;
+}
+
+// Rounds num / den towards negative infinity, for den > 0
+static long long floor_div(long long num, long long den) {
+    return num >= 0 ? num / den : -((-num + den - 1) / den);
+}
+
+// Symmetric shadowcasting. A floor tile is lit only when its centre lies inside the
+// unobstructed sector, which is what makes sight mutual; walls are lit when any part
+// of them is. Spans carry the same start (upper) and end (lower) slopes as cast_light.
+int cast_symmetric(const FovMap* map, int origin_x, int origin_y, int radius, int octant, VisibleArea* area) {
+    const OctantScan scan = begin_octant_scan(map, origin_x, origin_y, radius, octant);
+    const int xx = scan.xx, xy = scan.xy, yx = scan.yx, yy = scan.yy;
+
+    int min_x = area->min_x, max_x = area->max_x;
+    int min_y = area->min_y, max_y = area->max_y;
+    int scanned = 0;
+    bool is_complete = true;
+    fov_stack.count = 0;
+    if (!fov_push(1, 1, 1, 0, 1)) {
+        return -1;
+    }
+
+    while (fov_stack.count > 0) {
+        FovSpan span = fov_stack.spans[--fov_stack.count];
+
+        for (int dx = span.row; dx <= scan.max_row; dx++) {
+            if ((long long)span.start_num * span.end_den <= (long long)span.end_num * span.start_den) {
+                break;
+            }
+
+            // Every tile overlapping the open sector, so ties round inwards
+            int max_dy = (int)-floor_div(span.start_den - 2LL * dx * span.start_num, 2LL * span.start_den);
+            int min_dy = (int)floor_div(2LL * dx * span.end_num + span.end_den, 2LL * span.end_den);
+            if (scan.extents && max_dy > scan.extents[dx]) {
+                max_dy = scan.extents[dx];
+            }
+            if (max_dy > scan.dy_limit_high) max_dy = scan.dy_limit_high;
+            if (min_dy < scan.dy_limit_low) min_dy = scan.dy_limit_low;
+            if (max_dy < min_dy) {
+                break; // Past the map or the radius; deeper rows only get further out
+            }
+
+            // Not every tile in the row is lit, but its ends still bound it
+            int x = origin_x + dx * xx + max_dy * xy;
+            int y = origin_y + dx * yx + max_dy * yy;
+            int end_x = x - (max_dy - min_dy) * xy;
+            int end_y = y - (max_dy - min_dy) * yy;
+            if ((x < end_x ? x : end_x) < min_x) min_x = x < end_x ? x : end_x;
+            if ((x > end_x ? x : end_x) > max_x) max_x = x > end_x ? x : end_x;
+            if ((y < end_y ? y : end_y) < min_y) min_y = y < end_y ? y : end_y;
+            if ((y > end_y ? y : end_y) > max_y) max_y = y > end_y ? y : end_y;
+            scanned += max_dy - min_dy + 1;
+
+            bool prev_wall = false;
+            for (int dy = max_dy; dy >= min_dy; dy--, x -= xy, y -= yy) {
+                size_t word = plane_word(map->stride, x >> 6, y);
+                uint64_t bit = (uint64_t)1 << (x & 63);
+                bool wall = (map->opaque[word] & bit) != 0;
+
+                if (wall || ((long long)dy * span.end_den >= (long long)dx * span.end_num &&
+                             (long long)dy * span.start_den <= (long long)dx * span.start_num)) {
+                    map->visible[word] |= bit;
+                }
+
+                if (dy < max_dy) {
+                    if (prev_wall && !wall) {
+                        // Leaving a wall run: the sector now starts at this tile's upper edge
+                        span.start_num = 2 * dy + 1;
+                        span.start_den = 2 * dx;
+                    } else if (!prev_wall && wall) {
+                        // Entering one: the light above it carries on in its own span
+                        if (!fov_push(dx + 1, span.start_num, span.start_den, 2 * dy + 1, 2 * dx)) {
+                            is_complete = false;
+                            break;
+                        }
+                    }
+                }
+                prev_wall = wall;
+            }
+
+            if (prev_wall || !is_complete) {
+                break;
+            }
+        }
+        if (!is_complete) {
+            break;
+        }
+    }
+
+    area->min_x = min_x;
+    area->max_x = max_x;
+    area->min_y = min_y;
+    area->max_y = max_y;
+    return is_complete ? scanned : -1;
+}
+
+// A patch of a floor's walls at most a chunk across, so one cast can run without
+// touching the rest of the floor
+typedef struct {
+    uint64_t opaque[CHUNK_SIZE];
+    uint64_t visible[CHUNK_SIZE];
+} FovWindow;
+
+_Static_assert(2 * PLAYER_SIGHT_RADIUS + 1 <= CHUNK_SIZE && LIGHT_WINDOW <= CHUNK_SIZE, "Casts must fit in a FovWindow");
+
+// Copies the walls within radius of (x, y) into window, clipped to the floor so casts stop at
+// its edges just as they would on the floor itself, and returns the window as a map. origin
+// is set to where (x, y) falls in it. radius must leave the window no wider than a chunk.
+static FovMap fov_window(const Floor* floor, int x, int y, int radius, FovWindow* window, SDL_Point* origin) {
+    int left = x - radius < 0 ? 0 : x - radius;
+    int top = y - radius < 0 ? 0 : y - radius;
+    int right = x + radius >= floor->width ? floor->width - 1 : x + radius;
+    int bottom = y + radius >= floor->height ? floor->height - 1 : y + radius;
+    FovMap map = { right - left + 1, bottom - top + 1, 1, window->opaque, window->visible, NULL };
+    for (int row = 0; row < map.height; row++) {
+        window->opaque[row] = plane_run(floor->opaque, floor->stride, left, top + row, map.width);
+        window->visible[row] = 0;
+    }
+    *origin = (SDL_Point){ x - left, y - top };
+    return map;
+}
+
+// Whether a viewer at (x, y) with the player's sight radius can see the player.
+// Symmetric sight answers this from the player's own FOV; otherwise the viewer casts.
+bool can_see_player(GameState* game_state, int x, int y) {
+    Floor* floor = player_floor(game_state);
+    if (!floor || x < 0 || x >= floor->width || y < 0 || y >= floor->height) {
+        return false;
+    }
+    if (game_state->fov_mode == FOV_SYMMETRIC) {
+        return plane_get(floor->visible, floor->stride, x, y);
+    }
+
+    FovWindow window;
+    SDL_Point origin;
+    FovMap map = fov_window(floor, x, y, PLAYER_SIGHT_RADIUS, &window, &origin);
+    VisibleArea area = { -1, INT_MAX, INT_MAX, -1, -1 };
+    if (compute_fov(&map, origin.x, origin.y, PLAYER_SIGHT_RADIUS, FOV_SHADOWCAST, &area) < 0) {
+        return false;
+    }
+    int player_x = game_state->player.x - (x - origin.x);
+    int player_y = game_state->player.y - (y - origin.y);
+    return player_x >= 0 && player_x < map.width && player_y >= 0 && player_y < map.height && plane_get(window.visible, 1, player_x, player_y);
+}
+
+typedef struct {
+    FovMap map;
+    const SDL_Point* observers;
+    int radius;
+    FovMode mode;
+    uint64_t* visibility;
+    size_t plane_words;
+    SDL_atomic_t has_failed; // Some observer's cast ran out of memory
+} FovBatch;
+
+// Words per observer in a batch result, padded to whole cache lines
+size_t fov_plane_words(const FovMap* map) {
+    return plane_words(map->width, map->height); // Whole chunks, so always whole cache lines
+}
+
+static void fov_batch_job(void* data, int index) {
+    FovBatch* batch = data;
+    FovMap map = batch->map;
+    map.visible = batch->visibility + batch->plane_words * index;
+    map.explored = NULL;
+    memset(map.visible, 0, sizeof(uint64_t) * batch->plane_words);
+
+    VisibleArea area = { -1, INT_MAX, INT_MAX, -1, -1 };
+    if (compute_fov(&map, batch->observers[index].x, batch->observers[index].y, batch->radius, batch->mode, &area) < 0) {
+        SDL_AtomicSet(&batch->has_failed, 1);
+    }
+}
+
+// Casts FOV for every observer, spread over pool. Only map's opaque plane is read, so
+// it must not change until this returns. Observer i's visible plane is written to
+// visibility + i * fov_plane_words(map). Returns false if any cast ran out of memory.
+bool compute_fov_batch(ThreadPool* pool, const FovMap* map, const SDL_Point* observers, int observer_count, int radius, FovMode mode, uint64_t* visibility) {
+    FovBatch batch = { *map, observers, radius, mode, visibility, fov_plane_words(map), {0} };
+    thread_pool_run(pool, fov_batch_job, &batch, observer_count);
+    return SDL_AtomicGet(&batch.has_failed) == 0;
+}
+
+
+// --- Lighting Functions ---
+
+bool add_light(Floor* floor, int x, int y, int radius, Uint8 r, Uint8 g, Uint8 b) {
+    if (floor->light_count == MAX_FLOOR_LIGHTS) {
+        return false;
+    }
+    if (radius > MAX_LIGHT_SOURCE_RADIUS) {
+        radius = MAX_LIGHT_SOURCE_RADIUS;
+    }
+    floor->lights[floor->light_count++] = (LightSource){ (int16_t)x, (int16_t)y, (uint8_t)radius, r, g, b };
+    return true;
+}
+
+void remove_lights_at(Floor* floor, int x, int y) {
+    int kept = 0;
+    for (int i = 0; i < floor->light_count; i++) {
+        if (floor->lights[i].x != x || floor->lights[i].y != y) {
+            floor->lights[kept++] = floor->lights[i];
+        }
+    }
+    floor->light_count = kept;
+}
+
+// Sets up an empty light map for floors of width x height. Chunks are allocated as lights reach them.
+bool light_map_init(LightMap* light_map, int width, int height) {
+    int stride = (width + 63) / 64;
+    *light_map = (LightMap){ .floor_index = -1, .width = width, .height = height, .stride = stride };
+    light_map->chunk_count = stride * ((height + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    light_map->chunks = calloc(light_map->chunk_count, sizeof(LightChunk*));
+    light_map->contributions = calloc(MAX_FLOOR_LIGHTS, sizeof(LightContribution));
+    if (!light_map->chunks || !light_map->contributions) {
+        light_map_free(light_map);
+        return false;
+    }
+    return true;
+}
+
+static void free_light_chunks(LightMap* light_map) {
+    for (int i = 0; i < light_map->chunk_count; i++) {
+        free(light_map->chunks[i]);
+        light_map->chunks[i] = NULL;
+    }
+}
+
+void light_map_free(LightMap* light_map) {
+    if (light_map->chunks) {
+        free_light_chunks(light_map);
+    }
+    free(light_map->chunks);
+    free(light_map->contributions);
+    *light_map = (LightMap){ .floor_index = -1 };
+}
+
+// Summed RGB light at (x, y), or NULL where no light reaches
+const uint32_t* light_at(const LightMap* light_map, int x, int y) {
+    const LightChunk* chunk = light_map->chunks[chunk_index(light_map->stride, x, y)];
+    return chunk ? chunk->light[chunk_offset(x, y)] : NULL;
+}
+
+// Allocates the chunks under a source's reach that no light has reached before, copying in
+// the walls they hold. Returns false if one cannot be had.
+static bool reserve_light_chunks(LightMap* light_map, const Floor* floor, const LightSource* source) {
+    int left = source->x - source->radius < 0 ? 0 : source->x - source->radius;
+    int top = source->y - source->radius < 0 ? 0 : source->y - source->radius;
+    int right = source->x + source->radius >= floor->width ? floor->width - 1 : source->x + source->radius;
+    int bottom = source->y + source->radius >= floor->height ? floor->height - 1 : source->y + source->radius;
+    for (int y = top >> CHUNK_SHIFT; y <= bottom >> CHUNK_SHIFT; y++) {
+        for (int x = left >> CHUNK_SHIFT; x <= right >> CHUNK_SHIFT; x++) {
+            int i = y * light_map->stride + x;
+            if (light_map->chunks[i]) continue;
+            LightChunk* chunk = calloc(1, sizeof(LightChunk));
+            if (!chunk) {
+                fprintf(stderr, "Failed to allocate memory for the light map.\n");
+                return false;
+            }
+            chunk->revision = floor->chunks[i].revision;
+            memcpy(chunk->opaque, &floor->opaque[(size_t)i * CHUNK_SIZE], sizeof(chunk->opaque));
+            light_map->chunks[i] = chunk;
+        }
+    }
+    return true;
+}
+
+static bool same_light(const LightSource* a, const LightSource* b) {
+    return a->x == b->x && a->y == b->y && a->radius == b->radius && a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+// Adds (sign 1) or removes (sign -1) a cast contribution from the summed light. The chunks
+// under it must have been reserved.
+static void apply_contribution(LightMap* light_map, const LightContribution* contribution, int sign) {
+    int left = contribution->source.x - MAX_LIGHT_SOURCE_RADIUS;
+    int top = contribution->source.y - MAX_LIGHT_SOURCE_RADIUS;
+    int radius = contribution->source.radius;
+
+    for (int wy = MAX_LIGHT_SOURCE_RADIUS - radius; wy <= MAX_LIGHT_SOURCE_RADIUS + radius; wy++) {
+        int y = top + wy;
+        if (y < 0 || y >= light_map->height) continue;
+        for (int wx = MAX_LIGHT_SOURCE_RADIUS - radius; wx <= MAX_LIGHT_SOURCE_RADIUS + radius; wx++) {
+            int x = left + wx;
+            if (x < 0 || x >= light_map->width) continue;
+            const uint8_t* rgb = contribution->rgb[wy * LIGHT_WINDOW + wx];
+            uint32_t* light = light_map->chunks[chunk_index(light_map->stride, x, y)]->light[chunk_offset(x, y)];
+            light[0] += sign * rgb[0];
+            light[1] += sign * rgb[1];
+            light[2] += sign * rgb[2];
+        }
+    }
+}
+
+// Shadowcasts one source and fades its colour with distance over the tiles it reaches.
+// Returns false, leaving the source uncast to be tried again, if the cast ran out of memory.
+static bool cast_light_source(const Floor* floor, LightContribution* contribution, const LightSource* source) {
+    memset(contribution->rgb, 0, sizeof(contribution->rgb));
+    contribution->source = *source;
+    contribution->is_cast = true;
+
+    FovWindow window;
+    SDL_Point origin;
+    FovMap map = fov_window(floor, source->x, source->y, source->radius, &window, &origin);
+    VisibleArea area = { -1, INT_MAX, INT_MAX, -1, -1 };
+    if (compute_fov(&map, origin.x, origin.y, source->radius, FOV_SHADOWCAST, &area) < 0) {
+        contribution->is_cast = false;
+        return false;
+    }
+
+    int falloff = (source->radius + 1) * (source->radius + 1);
+    for (int y = area.min_y; y <= area.max_y; y++) {
+        for (int x = area.min_x; x <= area.max_x; x++) {
+            if (!plane_get(window.visible, 1, x, y)) continue;
+            int dx = x - origin.x;
+            int dy = y - origin.y;
+            int strength = falloff - (dx * dx + dy * dy);
+            uint8_t* rgb = contribution->rgb[(dy + MAX_LIGHT_SOURCE_RADIUS) * LIGHT_WINDOW + dx + MAX_LIGHT_SOURCE_RADIUS];
+            rgb[0] = (uint8_t)(source->r * strength / falloff);
+            rgb[1] = (uint8_t)(source->g * strength / falloff);
+            rgb[2] = (uint8_t)(source->b * strength / falloff);
+        }
+    }
+    return true;
+}
+
+// Brings the summed light up to date with floor and returns how many sources were recast.
+// A new floor recasts everything; otherwise only moved or edited sources, and sources in
+// reach of a tile whose opacity changed, are redone. floor must be the size the map was set up for.
+int update_light_map(LightMap* light_map, const Floor* floor, int floor_index) {
+    bool dirty[MAX_FLOOR_LIGHTS] = { false };
+
+    if (light_map->floor_index != floor_index) {
+        free_light_chunks(light_map);
+        for (int i = 0; i < MAX_FLOOR_LIGHTS; i++) {
+            light_map->contributions[i].is_cast = false;
+        }
+        light_map->floor_index = floor_index;
+        light_map->revision = floor->revision;
+        light_map->light_count = 0;
+        light_map->generation++;
+    } else if (light_map->revision != floor->revision) {
+        // Diff the walls of lit chunks that were edited, a word at a time. Edits in chunks
+        // no light reaches cannot matter.
+        for (int i = 0; i < light_map->chunk_count; i++) {
+            LightChunk* chunk = light_map->chunks[i];
+            if (!chunk || chunk->revision == floor->chunks[i].revision) continue;
+            const uint64_t* opaque = &floor->opaque[(size_t)i * CHUNK_SIZE];
+            for (int row = 0; row < CHUNK_SIZE; row++) {
+                uint64_t changed = chunk->opaque[row] ^ opaque[row];
+                chunk->opaque[row] = opaque[row];
+                while (changed) {
+                    int x = (i % light_map->stride) * CHUNK_SIZE + __builtin_ctzll(changed);
+                    int y = (i / light_map->stride) * CHUNK_SIZE + row;
+                    changed &= changed - 1;
+                    for (int l = 0; l < light_map->light_count; l++) {
+                        const LightSource* source = &light_map->contributions[l].source;
+                        if (abs(x - source->x) <= source->radius && abs(y - source->y) <= source->radius) {
+                            dirty[l] = true;
+                        }
+                    }
+                }
+            }
+            chunk->revision = floor->chunks[i].revision;
+        }
+        light_map->revision = floor->revision;
+    }
+
+    int recast = 0;
+    int slots = floor->light_count > light_map->light_count ? floor->light_count : light_map->light_count;
+    for (int i = 0; i < slots; i++) {
+        LightContribution* contribution = &light_map->contributions[i];
+        bool exists = i < floor->light_count;
+        if (contribution->is_cast && exists && !dirty[i] && same_light(&contribution->source, &floor->lights[i])) {
+            continue;
+        }
+
+        light_map->generation++;
+        if (contribution->is_cast) {
+            apply_contribution(light_map, contribution, -1);
+            contribution->is_cast = false;
+        }
+        if (exists && reserve_light_chunks(light_map, floor, &floor->lights[i]) &&
+            cast_light_source(floor, contribution, &floor->lights[i])) {
+            apply_contribution(light_map, contribution, 1);
+            recast++;
+        }
     }
+    light_map->light_count = floor->light_count;
+    return recast;
 }
 
-void carve_v_corridor(Floor* floor, int y1, int y2, int x) {
-    for (int y = (y1 < y2 ? y1 : y2); y <= (y1 > y2 ? y1 : y2); ++y) {
-        floor->tiles[y][x].type = TILE_GROUND;
+
+// --- Thread Pool Functions ---
+
+static void thread_pool_work(ThreadPool* pool) {
+    for (;;) {
+        int index = SDL_AtomicAdd(&pool->next_job, 1);
+        if (index >= pool->job_count) {
+            break;
+        }
+        pool->job(pool->job_data, index);
     }
 }
 
-// --- Field of View Functions ---
+static int thread_pool_worker(void* data) {
+    ThreadPool* pool = data;
+    int seen_generation = 0;
 
-void update_fov(GameState* game_state) {
-    Floor* floor = &game_state->dungeon.floors[game_state->current_floor_index];
-    
-    for (int y = 0; y < GRID_ROWS; y++) {
-        for (int x = 0; x < GRID_COLS; x++) {
-            floor->tiles[y][x].is_visible = false;
+    SDL_LockMutex(pool->lock);
+    for (;;) {
+        while (!pool->is_shutting_down && pool->generation == seen_generation) {
+            SDL_CondWait(pool->work_ready, pool->lock);
+        }
+        if (pool->is_shutting_down) {
+            break;
+        }
+        seen_generation = pool->generation;
+        pool->active_workers++;
+        SDL_UnlockMutex(pool->lock);
+
+        thread_pool_work(pool);
+
+        SDL_LockMutex(pool->lock);
+        if (--pool->active_workers == 0) {
+            SDL_CondSignal(pool->work_done);
         }
     }
+    SDL_UnlockMutex(pool->lock);
+
+    release_fov_stack();
+    release_scratch_arena();
+    return 0;
+}
 
-    floor->tiles[game_state->player.y][game_state->player.x].is_visible = true;
-    floor->tiles[game_state->player.y][game_state->player.x].is_explored = true;
+bool thread_pool_init(ThreadPool* pool, int thread_count) {
+    *pool = (ThreadPool){0};
+    pool->lock = SDL_CreateMutex();
+    pool->work_ready = SDL_CreateCond();
+    pool->work_done = SDL_CreateCond();
+    pool->threads = calloc(thread_count > 0 ? thread_count : 1, sizeof(SDL_Thread*));
+    if (!pool->lock || !pool->work_ready || !pool->work_done || !pool->threads) {
+        fprintf(stderr, "Could not create thread pool: %s\n", SDL_GetError());
+        thread_pool_shutdown(pool);
+        return false;
+    }
 
-    for (int i = 0; i < 8; i++) {
-        cast_light(game_state, i, 1, 1.0f, 0.0f);
+    for (int i = 0; i < thread_count; i++) {
+        pool->threads[i] = SDL_CreateThread(thread_pool_worker, "worker", pool);
+        if (!pool->threads[i]) {
+            fprintf(stderr, "Could not create worker thread: %s\n", SDL_GetError());
+            thread_pool_shutdown(pool);
+            return false;
+        }
+        pool->thread_count++;
     }
+    return true;
 }
 
-void cast_light(GameState* game_state, int octant, int row, float start_slope, float end_slope) {
-    Floor* floor = &game_state->dungeon.floors[game_state->current_floor_index];
-    int px = game_state->player.x;
-    int py = game_state->player.y;
-    
-    if (start_slope < end_slope) {
+// Runs job(data, i) for every i below count and returns once all of them are done
+void thread_pool_run(ThreadPool* pool, JobFunction job, void* data, int count) {
+    if (pool->thread_count == 0) {
+        for (int i = 0; i < count; i++) {
+            job(data, i);
+        }
         return;
     }
 
-    for (int i = row; i < GRID_ROWS + GRID_COLS; i++) {
-        int dx = i;
-        int dy = 0;
-        bool blocked = false;
-        
-        for (dy = roundf(dx * start_slope); dy >= roundf(dx * end_slope); dy--) {
-            int x = px, y = py;
-            switch(octant) {
-                case 0: x += dy; y -= dx; break;
-                case 1: x += dx; y -= dy; break;
-                case 2: x += dx; y += dy; break;
-                case 3: x += dy; y += dx; break;
-                case 4: x -= dy; y += dx; break;
-                case 5: x -= dx; y += dy; break;
-                case 6: x -= dx; y -= dy; break;
-                case 7: x -= dy; y -= dx; break;
-            }
-
-            if (x < 0 || x >= GRID_COLS || y < 0 || y >= GRID_ROWS) {
-                continue;
+    SDL_LockMutex(pool->lock);
+    // Stragglers from the last batch must be out before its job is replaced
+    while (pool->active_workers > 0) {
+        SDL_CondWait(pool->work_done, pool->lock);
+    }
+    pool->job = job;
+    pool->job_data = data;
+    pool->job_count = count;
+    SDL_AtomicSet(&pool->next_job, 0);
+    pool->generation++;
+    SDL_CondBroadcast(pool->work_ready);
+    SDL_UnlockMutex(pool->lock);
+
+    thread_pool_work(pool);
+
+    SDL_LockMutex(pool->lock);
+    while (pool->active_workers > 0) {
+        SDL_CondWait(pool->work_done, pool->lock);
+    }
+    SDL_UnlockMutex(pool->lock);
+}
+
+void thread_pool_shutdown(ThreadPool* pool) {
+    if (pool->lock) {
+        SDL_LockMutex(pool->lock);
+        pool->is_shutting_down = true;
+        if (pool->work_ready) {
+            SDL_CondBroadcast(pool->work_ready);
+        }
+        SDL_UnlockMutex(pool->lock);
+    }
+    for (int i = 0; i < pool->thread_count; i++) {
+        SDL_WaitThread(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    if (pool->work_done) SDL_DestroyCond(pool->work_done);
+    if (pool->work_ready) SDL_DestroyCond(pool->work_ready);
+    if (pool->lock) SDL_DestroyMutex(pool->lock);
+    *pool = (ThreadPool){0};
+}
+
+
+// --- Benchmark Functions ---
+
+// Benchmark floors take their seeds from rand(), so srand() still pins the maps.
+// floor must have been through floor_init().
+static bool generate_bench_floor(Floor* floor) {
+    Rng rng = floor_rng((uint64_t)rand(), 0);
+    return generate_floor(floor, &rng);
+}
+
+static void fill_bench_map(uint64_t* opaque, int width, int height, bool dungeon) {
+    int stride = (width + 63) / 64;
+    if (dungeon) {
+        // A floor generated at the map's size
+        Floor scratch;
+        if (floor_init(&scratch, width, height, -1, NULL)) {
+            if (generate_bench_floor(&scratch)) {
+                memcpy(opaque, scratch.opaque, plane_bytes(&scratch));
+            }
+            floor_free(&scratch);
+        }
+    } else {
+        // Open ground scattered with pillars
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                plane_set(opaque, stride, x, y, rand() % 100 < 4);
+            }
+        }
+    }
+}
+
+// Observers per second for batched FOV as worker threads are added, checking each batch
+// against the same observers cast one at a time
+static void run_fov_batch_benchmark(void) {
+    static const struct { int width, height; } sizes[] = { { GRID_COLS, GRID_ROWS }, { 320, 200 } };
+    enum { BENCH_OBSERVERS = 1024 };
+    int cpu_count = SDL_GetCPUCount();
+
+    printf("\n%-10s %-8s %12s %8s %10s\n", "map", "threads", "observers/s", "speedup", "identical");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int width = sizes[s].width;
+        int height = sizes[s].height;
+        int stride = (width + 63) / 64;
+        uint64_t* opaque = calloc(plane_words(width, height), sizeof(uint64_t));
+        FovMap map = { width, height, stride, opaque, NULL, NULL };
+        size_t words = fov_plane_words(&map);
+        uint64_t* visibility = opaque ? calloc(words * BENCH_OBSERVERS, sizeof(uint64_t)) : NULL;
+        uint64_t* expected = opaque ? calloc(words * BENCH_OBSERVERS, sizeof(uint64_t)) : NULL;
+        SDL_Point* observers = malloc(sizeof(SDL_Point) * BENCH_OBSERVERS);
+        if (!opaque || !visibility || !expected || !observers) {
+            fprintf(stderr, "Failed to allocate memory for benchmark map.\n");
+            free(opaque);
+            free(visibility);
+            free(expected);
+            free(observers);
+            return;
+        }
+
+        fill_bench_map(opaque, width, height, true);
+        for (int i = 0; i < BENCH_OBSERVERS; i++) {
+            do {
+                observers[i] = (SDL_Point){ rand() % width, rand() % height };
+            } while (plane_get(opaque, stride, observers[i].x, observers[i].y));
+        }
+        for (int i = 0; i < BENCH_OBSERVERS; i++) {
+            FovMap serial = map;
+            serial.visible = expected + words * i;
+            VisibleArea area = { -1, INT_MAX, INT_MAX, -1, -1 };
+            compute_fov(&serial, observers[i].x, observers[i].y, PLAYER_SIGHT_RADIUS, FOV_SHADOWCAST, &area);
+        }
+
+        double single_rate = 0.0;
+        // Doubling thread counts, finishing on every core
+        for (int threads = 1; ; threads = threads * 2 < cpu_count ? threads * 2 : cpu_count) {
+            ThreadPool pool;
+            if (!thread_pool_init(&pool, threads - 1)) {
+                break;
+            }
+
+            long long runs = 0;
+            Uint64 start = SDL_GetPerformanceCounter();
+            Uint64 budget = SDL_GetPerformanceFrequency() / 2;
+            while (SDL_GetPerformanceCounter() - start < budget) {
+                compute_fov_batch(&pool, &map, observers, BENCH_OBSERVERS, PLAYER_SIGHT_RADIUS, FOV_SHADOWCAST, visibility);
+                runs += BENCH_OBSERVERS;
+            }
+            double rate = runs / ((double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency());
+            thread_pool_shutdown(&pool);
+            bool identical = memcmp(visibility, expected, sizeof(uint64_t) * words * BENCH_OBSERVERS) == 0;
+
+            if (threads == 1) {
+                single_rate = rate;
+            }
+            char map_name[16];
+            snprintf(map_name, sizeof(map_name), "%dx%d", width, height);
+            printf("%-10s %-8d %12.0f %7.2fx %10s\n", map_name, threads, rate, rate / single_rate, identical ? "yes" : "NO");
+            if (threads >= cpu_count) {
+                break;
+            }
+        }
+
+        free(opaque);
+        free(visibility);
+        free(expected);
+        free(observers);
+    }
+}
+
+// Checks that symmetric sight is mutual, which is what lets can_see_player() answer from the
+// player's FOV alone: every open tile an origin lights must light the origin in turn
+static void run_symmetry_check(void) {
+    // Unlimited sight on larger maps would recast thousands of tiles per lit tile
+    static const struct { int width, height, radius; } cases[] = {
+        { GRID_COLS, GRID_ROWS, 0 }, { GRID_COLS, GRID_ROWS, PLAYER_SIGHT_RADIUS }, { 320, 200, PLAYER_SIGHT_RADIUS },
+    };
+    enum { CHECK_ORIGINS = 16 };
+
+    printf("\n%-10s %-8s %-7s %12s %10s\n", "symmetry", "layout", "radius", "pairs", "one-way");
+    for (size_t c = 0; c < 2 * sizeof(cases) / sizeof(cases[0]); c++) {
+        bool dungeon = c % 2 == 0;
+        int width = cases[c / 2].width;
+        int height = cases[c / 2].height;
+        int radius = cases[c / 2].radius;
+        int stride = (width + 63) / 64;
+        size_t words = plane_words(width, height);
+        uint64_t* opaque = calloc(words, sizeof(uint64_t));
+        uint64_t* seen = calloc(words, sizeof(uint64_t));
+        uint64_t* seen_back = calloc(words, sizeof(uint64_t));
+        if (!opaque || !seen || !seen_back) {
+            fprintf(stderr, "Failed to allocate memory for benchmark map.\n");
+            free(opaque);
+            free(seen);
+            free(seen_back);
+            return;
+        }
+        fill_bench_map(opaque, width, height, dungeon);
+        FovMap map = { width, height, stride, opaque, seen, NULL };
+        FovMap back = { width, height, stride, opaque, seen_back, NULL };
+        VisibleArea area = { 0, INT_MAX, INT_MAX, -1, -1 };
+        VisibleArea back_area = { 0, INT_MAX, INT_MAX, -1, -1 };
+
+        long long pairs = 0;
+        long long one_way = 0;
+        for (int i = 0; i < CHECK_ORIGINS; i++) {
+            SDL_Point origin;
+            do {
+                origin = (SDL_Point){ rand() % width, rand() % height };
+            } while (plane_get(opaque, stride, origin.x, origin.y));
+
+            clear_visible_area(&map, &area);
+            compute_fov(&map, origin.x, origin.y, radius, FOV_SYMMETRIC, &area);
+            for (int y = area.min_y; y <= area.max_y; y++) {
+                for (int x = area.min_x; x <= area.max_x; x++) {
+                    if (!plane_get(seen, stride, x, y) || plane_get(opaque, stride, x, y)) continue;
+                    clear_visible_area(&back, &back_area);
+                    compute_fov(&back, x, y, radius, FOV_SYMMETRIC, &back_area);
+                    pairs++;
+                    one_way += !plane_get(seen_back, stride, origin.x, origin.y);
+                }
+            }
+        }
+
+        char map_name[16];
+        char radius_name[12];
+        snprintf(map_name, sizeof(map_name), "%dx%d", width, height);
+        if (radius > 0) {
+            snprintf(radius_name, sizeof(radius_name), "%d", radius);
+        } else {
+            snprintf(radius_name, sizeof(radius_name), "-");
+        }
+        printf("%-10s %-8s %-7s %12lld %10lld\n", map_name, dungeon ? "dungeon" : "pillars", radius_name, pairs, one_way);
+        free(opaque);
+        free(seen);
+        free(seen_back);
+    }
+}
+
+// cast_light as it was before the transform table: an octant switch and a bounds check on
+// every tile. Kept so the benchmark can time the two forms against each other.
+static int cast_light_switch(const FovMap* map, int origin_x, int origin_y, int radius, int octant, VisibleArea* area) {
+    // Rows beyond the map edge along the octant's main axis hold no tiles at all
+    int max_row = 0;
+    switch (octant) {
+        case 0: case 7: max_row = origin_y; break;
+        case 1: case 2: max_row = map->width - 1 - origin_x; break;
+        case 3: case 4: max_row = map->height - 1 - origin_y; break;
+        case 5: case 6: max_row = origin_x; break;
+    }
+    const uint8_t* extents = NULL;
+    if (radius > 0) {
+        extents = light_extents[radius];
+        if (max_row > radius) {
+            max_row = radius;
+        }
+    }
+
+    int scanned = 0;
+    fov_stack.count = 0;
+    fov_push(1, 1, 1, 0, 1);
+    while (fov_stack.count > 0) {
+        FovSpan span = fov_stack.spans[--fov_stack.count];
+        if ((long long)span.start_num * span.end_den < (long long)span.end_num * span.start_den) {
+            continue;
+        }
+
+        for (int dx = span.row; dx <= max_row; dx++) {
+            int next_start_num = span.start_num;
+            int next_start_den = span.start_den;
+            int min_dy = fov_round(dx, span.end_num, span.end_den);
+            int max_dy = fov_round(dx, span.start_num, span.start_den);
+            if (extents && max_dy > extents[dx]) {
+                max_dy = extents[dx];
+            }
+            bool blocked = false;
+
+            for (int dy = max_dy; dy >= min_dy; dy--) {
+                int x = origin_x, y = origin_y;
+                switch (octant) {
+                    case 0: x += dy; y -= dx; break;
+                    case 1: x += dx; y -= dy; break;
+                    case 2: x += dx; y += dy; break;
+                    case 3: x += dy; y += dx; break;
+                    case 4: x -= dy; y += dx; break;
+                    case 5: x -= dx; y += dy; break;
+                    case 6: x -= dx; y -= dy; break;
+                    case 7: x -= dy; y -= dx; break;
+                }
+                if (x < 0 || x >= map->width || y < 0 || y >= map->height) {
+                    continue;
+                }
+
+                size_t word = plane_word(map->stride, x >> 6, y);
+                uint64_t bit = (uint64_t)1 << (x & 63);
+                map->visible[word] |= bit;
+                if (x < area->min_x) area->min_x = x;
+                if (x > area->max_x) area->max_x = x;
+                if (y < area->min_y) area->min_y = y;
+                if (y > area->max_y) area->max_y = y;
+                scanned++;
+
+                if (map->opaque[word] & bit) {
+                    if (!blocked) {
+                        fov_push(dx + 1, span.start_num, span.start_den, 2 * dy + 1, 2 * dx - 1);
+                        blocked = true;
+                    }
+                    next_start_num = 2 * dy - 1;
+                    next_start_den = 2 * dx + 1;
+                } else if (blocked) {
+                    span.start_num = next_start_num;
+                    span.start_den = next_start_den;
+                    blocked = false;
+                }
+            }
+            if (blocked) {
+                break;
+            }
+        }
+    }
+    return scanned;
+}
+
+// Whole cast_light passes, the old switch form against the transform table, on the same
+// origins. Both forms must light the same tiles before either is timed.
+static void run_octant_benchmark(void) {
+    static const struct { int width, height; } sizes[] = { { GRID_COLS, GRID_ROWS }, { 1024, 1024 } };
+    enum { BENCH_ORIGINS = 256 };
+
+    printf("\n%-10s %-8s %-7s %16s %16s %9s %10s\n", "octants", "layout", "radius", "switch tiles/s", "table tiles/s", "speedup", "identical");
+    for (size_t s = 0; s < 2 * sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bool dungeon = s % 2 == 0;
+        int width = sizes[s / 2].width;
+        int height = sizes[s / 2].height;
+        int stride = (width + 63) / 64;
+        size_t words = plane_words(width, height);
+        uint64_t* opaque = calloc(words, sizeof(uint64_t));
+        uint64_t* visible = calloc(words, sizeof(uint64_t));
+        uint64_t* expected = calloc(words, sizeof(uint64_t));
+        if (!opaque || !visible || !expected) {
+            fprintf(stderr, "Failed to allocate memory for benchmark map.\n");
+            free(opaque);
+            free(visible);
+            free(expected);
+            return;
+        }
+        FovMap map = { width, height, stride, opaque, visible, NULL };
+        fill_bench_map(opaque, width, height, dungeon);
+
+        SDL_Point origins[BENCH_ORIGINS];
+        for (int i = 0; i < BENCH_ORIGINS; i++) {
+            do {
+                origins[i] = (SDL_Point){ rand() % width, rand() % height };
+            } while (plane_get(opaque, stride, origins[i].x, origins[i].y));
+        }
+
+        for (int pass = 0; pass < 2; pass++) {
+            int radius = pass == 0 ? 0 : PLAYER_SIGHT_RADIUS;
+            bool identical = true;
+            for (int i = 0; i < BENCH_ORIGINS && identical; i++) {
+                VisibleArea areas[2];
+                int scanned[2] = { 0, 0 };
+                for (int form = 0; form < 2; form++) {
+                    memset(visible, 0, words * sizeof(uint64_t));
+                    areas[form] = (VisibleArea){ 0, INT_MAX, INT_MAX, -1, -1 };
+                    for (int octant = 0; octant < 8; octant++) {
+                        scanned[form] += form == 0 ? cast_light_switch(&map, origins[i].x, origins[i].y, radius, octant, &areas[form])
+                                                   : cast_light(&map, origins[i].x, origins[i].y, radius, octant, &areas[form]);
+                    }
+                    if (form == 0) {
+                        memcpy(expected, visible, words * sizeof(uint64_t));
+                    }
+                }
+                identical = scanned[0] == scanned[1] && memcmp(&areas[0], &areas[1], sizeof(VisibleArea)) == 0 &&
+                            memcmp(expected, visible, words * sizeof(uint64_t)) == 0;
+            }
+
+            double rates[2];
+            VisibleArea area = { 0, INT_MAX, INT_MAX, -1, -1 };
+            for (int form = 0; form < 2; form++) {
+                long long scanned = 0;
+                Uint64 start = SDL_GetPerformanceCounter();
+                Uint64 budget = SDL_GetPerformanceFrequency() / 2;
+                while (SDL_GetPerformanceCounter() - start < budget) {
+                    for (int i = 0; i < BENCH_ORIGINS; i++) {
+                        clear_visible_area(&map, &area);
+                        for (int octant = 0; octant < 8; octant++) {
+                            scanned += form == 0 ? cast_light_switch(&map, origins[i].x, origins[i].y, radius, octant, &area)
+                                                 : cast_light(&map, origins[i].x, origins[i].y, radius, octant, &area);
+                        }
+                    }
+                }
+                rates[form] = scanned / ((double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency());
+            }
+
+            char map_name[16];
+            char radius_name[8];
+            snprintf(map_name, sizeof(map_name), "%dx%d", width, height);
+            if (radius > 0) {
+                snprintf(radius_name, sizeof(radius_name), "%d", radius);
+            } else {
+                snprintf(radius_name, sizeof(radius_name), "-");
+            }
+            printf("%-10s %-8s %-7s %16.0f %16.0f %8.2fx %10s\n", map_name, dungeon ? "dungeon" : "pillars", radius_name, rates[0], rates[1], rates[1] / rates[0],
+                   identical ? "yes" : "NO");
+        }
+        free(opaque);
+        free(visible);
+        free(expected);
+    }
+}
+
+// Per-move update_fov cost for a player wandering a floor, with and without the cache
+static void run_fov_cache_benchmark(void) {
+    enum { BENCH_MOVES = 200000 };
+    GameState game_state = { .is_running = true };
+    if (!dungeon_init(&game_state.dungeon, 1, GRID_COLS, GRID_ROWS, (uint64_t)rand())) {
+        return;
+    }
+    Floor* floor = dungeon_floor(&game_state.dungeon, 0);
+    if (!floor) {
+        dungeon_free(&game_state.dungeon);
+        return;
+    }
+    printf("\n%-10s %12s %9s\n", "fov cache", "moves/s", "hit rate");
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (!fov_cache_init(&game_state.fov_cache, pass == 0 ? 0 : FOV_CACHE_ENTRIES)) {
+            fprintf(stderr, "Failed to allocate memory for the FOV cache.\n");
+            dungeon_free(&game_state.dungeon);
+            return;
+        }
+        game_state.visible_area = (VisibleArea){ -1, INT_MAX, INT_MAX, -1, -1 };
+        game_state.player.x = floor->stairs_up.x;
+        game_state.player.y = floor->stairs_up.y;
+
+        // The same random walk both times
+        srand(7);
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < BENCH_MOVES; i++) {
+            static const SDL_Point steps[] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+            SDL_Point step = steps[rand() % 4];
+            int x = game_state.player.x + step.x;
+            int y = game_state.player.y + step.y;
+            if (x >= 0 && x < floor->width && y >= 0 && y < floor->height && plane_get(floor->passable, floor->stride, x, y)) {
+                game_state.player.x = x;
+                game_state.player.y = y;
+            }
+            update_fov(&game_state, PLAYER_SIGHT_RADIUS);
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+        const FovCache* cache = &game_state.fov_cache;
+        double hit_rate = cache->hits + cache->misses > 0 ? 100.0 * cache->hits / (cache->hits + cache->misses) : 0.0;
+        printf("%-10s %12.0f %8.1f%%\n", pass == 0 ? "off" : "on", BENCH_MOVES / seconds, hit_rate);
+        fov_cache_free(&game_state.fov_cache);
+    }
+    dungeon_free(&game_state.dungeon);
+}
+
+void run_fov_benchmark(void) {
+    static const struct { int width, height; } sizes[] = { { GRID_COLS, GRID_ROWS }, { 320, 200 }, { 1280, 800 }, { 1024, 1024 } };
+    enum { BENCH_ORIGINS = 256 };
+
+    srand(1); // Keep maps identical between runs
+    printf("%-10s %-8s %-7s %-10s %12s %14s\n", "map", "layout", "radius", "mode", "fov/s", "tiles/s");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int width = sizes[s].width;
+        int height = sizes[s].height;
+        int stride = (width + 63) / 64;
+        uint64_t* opaque = calloc(plane_words(width, height), sizeof(uint64_t));
+        uint64_t* visible = calloc(plane_words(width, height), sizeof(uint64_t));
+        uint64_t* explored = calloc(plane_words(width, height), sizeof(uint64_t));
+        if (!opaque || !visible || !explored) {
+            fprintf(stderr, "Failed to allocate memory for benchmark map.\n");
+            free(opaque);
+            free(visible);
+            free(explored);
+            return;
+        }
+        FovMap map = { width, height, stride, opaque, visible, explored };
+
+        for (int layout = 0; layout < 2; layout++) {
+            bool dungeon = layout == 0;
+            fill_bench_map(opaque, width, height, dungeon);
+            memset(visible, 0, sizeof(uint64_t) * plane_words(width, height));
+            VisibleArea area = { 0, INT_MAX, INT_MAX, -1, -1 };
+
+            SDL_Point origins[BENCH_ORIGINS];
+            for (int i = 0; i < BENCH_ORIGINS; i++) {
+                do {
+                    origins[i] = (SDL_Point){ rand() % width, rand() % height };
+                } while (plane_get(opaque, stride, origins[i].x, origins[i].y));
+            }
+
+            // Unlimited sight, then the player's radius in both modes
+            for (int pass = 0; pass < 3; pass++) {
+                int radius = pass == 0 ? 0 : PLAYER_SIGHT_RADIUS;
+                FovMode mode = pass == 2 ? FOV_SYMMETRIC : FOV_SHADOWCAST;
+                long long runs = 0;
+                long long scanned = 0;
+                Uint64 start = SDL_GetPerformanceCounter();
+                Uint64 budget = SDL_GetPerformanceFrequency() / 2;
+                while (SDL_GetPerformanceCounter() - start < budget) {
+                    // Same per-move work as update_fov: reset last pass, then cast
+                    for (int i = 0; i < BENCH_ORIGINS; i++) {
+                        clear_visible_area(&map, &area);
+                        scanned += compute_fov(&map, origins[i].x, origins[i].y, radius, mode, &area);
+                    }
+                    runs += BENCH_ORIGINS;
+                }
+                double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+                char map_name[16];
+                char radius_name[8];
+                snprintf(map_name, sizeof(map_name), "%dx%d", width, height);
+                if (radius > 0) {
+                    snprintf(radius_name, sizeof(radius_name), "%d", radius);
+                } else {
+                    snprintf(radius_name, sizeof(radius_name), "-");
+                }
+                printf("%-10s %-8s %-7s %-10s %12.0f %14.0f\n", map_name, dungeon ? "dungeon" : "pillars", radius_name,
+                       mode == FOV_SYMMETRIC ? "symmetric" : "shadowcast", runs / seconds, scanned / seconds);
+            }
+        }
+        free(opaque);
+        free(visible);
+        free(explored);
+    }
+
+    run_fov_batch_benchmark();
+    run_fov_cache_benchmark();
+    run_octant_benchmark();
+    run_symmetry_check();
+}
+
+// Full light map builds against single wall toggles as the number of lights grows
+void run_light_benchmark(void) {
+    static const int light_counts[] = { 100, 300, MAX_FLOOR_LIGHTS };
+    Floor floor;
+    LightMap light_map;
+    if (!floor_init(&floor, GRID_COLS, GRID_ROWS, -1, NULL)) {
+        fprintf(stderr, "Failed to allocate memory for the benchmark floor.\n");
+        return;
+    }
+    if (!light_map_init(&light_map, GRID_COLS, GRID_ROWS)) {
+        fprintf(stderr, "Failed to allocate memory for the light map.\n");
+        floor_free(&floor);
+        return;
+    }
+
+    printf("%-8s %14s %14s %12s\n", "lights", "full build ms", "wall edit ms", "recast/edit");
+
+    for (size_t c = 0; c < sizeof(light_counts) / sizeof(light_counts[0]); c++) {
+        generate_bench_floor(&floor);
+        while (floor.light_count < light_counts[c]) {
+            int x = rand() % floor.width;
+            int y = rand() % floor.height;
+            if (plane_get(floor.passable, floor.stride, x, y)) {
+                add_light(&floor, x, y, 4 + rand() % (MAX_LIGHT_SOURCE_RADIUS - 3), rand() % 256, rand() % 256, rand() % 256);
+            }
+        }
+        floor.light_count = light_counts[c];
+
+        double ms_per_count = 1000.0 / SDL_GetPerformanceFrequency();
+        int builds = 0;
+        Uint64 start = SDL_GetPerformanceCounter();
+        Uint64 budget = SDL_GetPerformanceFrequency() / 2;
+        while (SDL_GetPerformanceCounter() - start < budget) {
+            light_map.floor_index = -1;
+            update_light_map(&light_map, &floor, 0);
+            builds++;
+        }
+        double build_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count / builds;
+
+        // Knock out and restore walls at random, as digging or doors would
+        int edits = 0;
+        long long recast = 0;
+        start = SDL_GetPerformanceCounter();
+        while (SDL_GetPerformanceCounter() - start < budget) {
+            int x = 1 + rand() % (floor.width - 2);
+            int y = 1 + rand() % (floor.height - 2);
+            TileType type = get_tile_type(&floor, x, y);
+            if (type != TILE_WALL && type != TILE_GROUND) continue;
+            set_tile_type(&floor, x, y, type == TILE_WALL ? TILE_GROUND : TILE_WALL);
+            recast += update_light_map(&light_map, &floor, 0);
+            edits++;
+        }
+        double edit_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count / edits;
+
+        printf("%-8d %14.3f %14.3f %12.1f\n", light_counts[c], build_ms, edit_ms, (double)recast / edits);
+    }
+
+    light_map_free(&light_map);
+    floor_free(&floor);
+}
+
+// The per-tile draw loop render used before tiles were bucketed by colour
+static int draw_map_per_tile(SDL_Renderer* renderer, const Floor* floor) {
+    int calls = 0;
+    for (int y = 0; y < floor->height; ++y) {
+        for (int x = 0; x < floor->width; ++x) {
+            SDL_Rect tile_rect = { x * TILE_WIDTH, y * TILE_HEIGHT, TILE_WIDTH, TILE_HEIGHT };
+            int seen = plane_get(floor->visible, floor->stride, x, y) ? 1 : plane_get(floor->explored, floor->stride, x, y) ? 0 : -1;
+            if (seen < 0) continue;
+            SDL_Color color = tile_colors[seen][get_tile_type(floor, x, y)];
+            SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+            SDL_RenderFillRect(renderer, &tile_rect);
+            calls++;
+        }
+    }
+    return calls;
+}
+
+// Frame times for drawing a fully explored floor: per tile, bucketed, a copy of the map texture,
+// and glyphs when a font is given
+void run_render_benchmark(const char* font_path) {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        fprintf(stderr, "Could not initialize SDL: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_Window* window = SDL_CreateWindow("C Roguelike", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_HIDDEN);
+    SDL_Renderer* renderer = window ? SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED) : NULL;
+    if (!renderer) {
+        fprintf(stderr, "Could not create renderer: %s\n", SDL_GetError());
+        if (window) SDL_DestroyWindow(window);
+        SDL_Quit();
+        return;
+    }
+
+    // Everything explored and the left half in view, so every bucket is in use
+    Floor floor;
+    if (!floor_init(&floor, VIEW_COLS, VIEW_ROWS, -1, NULL) || !generate_bench_floor(&floor)) {
+        fprintf(stderr, "Failed to generate the benchmark floor.\n");
+        floor_free(&floor);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return;
+    }
+    memset(floor.explored, 0xFF, plane_bytes(&floor));
+    for (int y = 0; y < floor.height; y++) {
+        for (int x = 0; x < floor.width / 2; x++) {
+            plane_set(floor.visible, floor.stride, x, y, true);
+        }
+    }
+    SDL_Point camera = { 0, 0 };
+
+    SDL_Texture* map_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (map_texture) {
+        SDL_SetRenderTarget(renderer, map_texture);
+        draw_map(renderer, &floor, NULL, camera);
+        SDL_SetRenderTarget(renderer, NULL);
+    }
+
+    SDL_Texture* glyph_atlas = NULL;
+    if (font_path) {
+        TTF_Init();
+        glyph_atlas = build_glyph_atlas(renderer, font_path);
+    }
+
+    static const char* names[] = { "per tile", "bucketed", "texture", "glyphs" };
+    printf("%-10s %10s %12s %10s\n", "draw", "frames", "calls/frame", "ms/frame");
+    for (int mode = 0; mode < 4; mode++) {
+        if ((mode == 2 && !map_texture) || (mode == 3 && !glyph_atlas)) continue;
+        int frames = 0;
+        int calls = 0;
+        Uint64 start = SDL_GetPerformanceCounter();
+        Uint64 budget = SDL_GetPerformanceFrequency();
+        while (SDL_GetPerformanceCounter() - start < budget) {
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            if (mode == 0) {
+                calls = draw_map_per_tile(renderer, &floor);
+            } else if (mode == 1) {
+                calls = draw_map(renderer, &floor, NULL, camera);
+            } else if (mode == 2) {
+                SDL_RenderCopy(renderer, map_texture, NULL, NULL);
+            } else {
+                calls = draw_map_glyphs(renderer, glyph_atlas, &floor, NULL, camera);
             }
+            SDL_RenderPresent(renderer);
+            frames++;
+        }
+        double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency() / frames;
+        printf("%-10s %10d %12d %10.3f\n", names[mode], frames, calls, ms);
+    }
 
-            floor->tiles[y][x].is_visible = true;
-            floor->tiles[y][x].is_explored = true;
+    if (map_texture) SDL_DestroyTexture(map_texture);
+    if (glyph_atlas) {
+        SDL_DestroyTexture(glyph_atlas);
+        TTF_Quit();
+    }
+    floor_free(&floor);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+}
 
-            if (floor->tiles[y][x].type == TILE_WALL) {
-                if (blocked) {
-                    cast_light(game_state, octant, i + 1, start_slope, (dy + 0.5f) / (dx - 0.5f));
+// The per-cell lake automaton step generate_lakes used before rows were packed into words
+static void ca_step_per_cell(bool old_map[GRID_ROWS][GRID_COLS], bool new_map[GRID_ROWS][GRID_COLS]) {
+    for (int y = 0; y < GRID_ROWS; y++) {
+        for (int x = 0; x < GRID_COLS; x++) {
+            int count = 0;
+            for (int i = -1; i < 2; i++) {
+                for (int j = -1; j < 2; j++) {
+                    if (i == 0 && j == 0) continue;
+                    int nx = x + i;
+                    int ny = y + j;
+                    if (nx < 0 || nx >= GRID_COLS || ny < 0 || ny >= GRID_ROWS || old_map[ny][nx]) {
+                        count++;
+                    }
                 }
-                start_slope = (dy - 0.5f) / (dx + 0.5f);
-                blocked = true;
+            }
+            new_map[y][x] = old_map[y][x] ? count >= 4 : count >= 5;
+        }
+    }
+}
+
+// Lake automaton steps per second, per cell against bit-parallel
+static void run_lake_benchmark(void) {
+    enum { STRIDE = (GRID_COLS + 63) / 64, CHUNK_ROWS = (GRID_ROWS + CHUNK_SIZE - 1) / CHUNK_SIZE };
+    static bool cells[2][GRID_ROWS][GRID_COLS];
+    static uint64_t words[2][CHUNK_ROWS * STRIDE * CHUNK_SIZE];
+    double rates[2];
+
+    memset(words, 0, sizeof(words));
+    for (int y = 0; y < GRID_ROWS; y++) {
+        for (int x = 0; x < GRID_COLS; x++) {
+            cells[0][y][x] = rand() % 100 < CA_CHANCE_TO_START_ALIVE;
+            plane_set(words[0], STRIDE, x, y, cells[0][y][x]);
+        }
+        words[0][plane_word(STRIDE, STRIDE - 1, y)] |= CA_PADDING(GRID_COLS);
+    }
+
+    // Both run the same number of steps from the same start, so the results can be compared
+    enum { BENCH_STEPS = 2000 };
+    printf("\n%-10s %12s\n", "lake step", "steps/s");
+    for (int pass = 0; pass < 2; pass++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < BENCH_STEPS; i++) {
+            if (pass == 0) {
+                ca_step_per_cell(cells[i & 1], cells[(i + 1) & 1]);
             } else {
-                blocked = false;
+                ca_step(words[i & 1], words[(i + 1) & 1], GRID_COLS, GRID_ROWS);
             }
         }
+        rates[pass] = BENCH_STEPS / ((double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency());
+        printf("%-10s %12.0f\n", pass == 0 ? "per cell" : "packed", rates[pass]);
+    }
 
-        if (blocked) {
-            break;
+    bool identical = true;
+    for (int y = 0; y < GRID_ROWS; y++) {
+        for (int x = 0; x < GRID_COLS; x++) {
+            identical &= cells[BENCH_STEPS & 1][y][x] == plane_get(words[BENCH_STEPS & 1], STRIDE, x, y);
+        }
+    }
+    printf("%-10s %11.2fx (%s)\n", "speedup", rates[1] / rates[0], identical ? "identical" : "MISMATCH");
+}
+
+// Whether two generated floors came out the same
+static bool same_floor(const Floor* a, const Floor* b) {
+    return a->width == b->width && a->height == b->height && a->revision == b->revision &&
+           memcmp(a->types, b->types, (size_t)CHUNK_TILES * a->chunk_count) == 0 &&
+           memcmp(a->opaque, b->opaque, plane_bytes(a)) == 0 &&
+           memcmp(a->passable, b->passable, plane_bytes(a)) == 0 &&
+           a->stairs_up.x == b->stairs_up.x && a->stairs_up.y == b->stairs_up.y &&
+           a->stairs_down.x == b->stairs_down.x && a->stairs_down.y == b->stairs_down.y &&
+           a->light_count == b->light_count && memcmp(a->lights, b->lights, sizeof(LightSource) * a->light_count) == 0;
+}
+
+// Time to build dungeons of increasing depth and floor size on one thread and on every core
+void run_generation_benchmark(void) {
+    static const struct { int floor_count, width, height; } runs[] = {
+        { DUNGEON_FLOOR_COUNT, GRID_COLS, GRID_ROWS }, { 32, GRID_COLS, GRID_ROWS }, { 128, GRID_COLS, GRID_ROWS }, { 8, 1024, 1024 }
+    };
+    int cpu_count = SDL_GetCPUCount();
+    printf("%-8s %-10s %8s %12s %12s %8s %10s\n", "floors", "size", "threads", "serial ms", "pooled ms", "speedup", "identical");
+
+    for (size_t c = 0; c < sizeof(runs) / sizeof(runs[0]); c++) {
+        int floor_count = runs[c].floor_count;
+        Floor* serial = calloc(floor_count, sizeof(Floor));
+        Floor* pooled = calloc(floor_count, sizeof(Floor));
+        bool is_ready = serial && pooled;
+        for (int i = 0; i < floor_count && is_ready; i++) {
+            is_ready = floor_init(&serial[i], runs[c].width, runs[c].height, -1, NULL) && floor_init(&pooled[i], runs[c].width, runs[c].height, -1, NULL);
+        }
+        ThreadPool pool;
+        if (!is_ready || !thread_pool_init(&pool, cpu_count - 1)) {
+            fprintf(stderr, "Failed to set up the generation benchmark.\n");
+            for (int i = 0; i < floor_count && serial && pooled; i++) {
+                floor_free(&serial[i]);
+                floor_free(&pooled[i]);
+            }
+            free(serial);
+            free(pooled);
+            return;
+        }
+
+        double ms_per_count = 1000.0 / SDL_GetPerformanceFrequency();
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < floor_count; i++) {
+            Rng rng = floor_rng(1, i);
+            generate_floor(&serial[i], &rng);
+        }
+        double serial_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+
+        start = SDL_GetPerformanceCounter();
+        generate_dungeon(&pool, pooled, floor_count, 1);
+        double pooled_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+
+        bool identical = true;
+        for (int i = 0; i < floor_count; i++) {
+            identical &= same_floor(&serial[i], &pooled[i]);
+        }
+        char size_name[16];
+        snprintf(size_name, sizeof(size_name), "%dx%d", runs[c].width, runs[c].height);
+        printf("%-8d %-10s %8d %12.2f %12.2f %7.2fx %10s\n", floor_count, size_name, cpu_count, serial_ms, pooled_ms, serial_ms / pooled_ms, identical ? "yes" : "NO");
+
+        thread_pool_shutdown(&pool);
+        for (int i = 0; i < floor_count; i++) {
+            floor_free(&serial[i]);
+            floor_free(&pooled[i]);
+        }
+        free(serial);
+        free(pooled);
+    }
+    run_lake_benchmark();
+}
+
+// Time to play through dungeons floor by floor, save them, and load them back. Play only
+// waits for a save's snapshot; the save thread writes and syncs it meanwhile. Saving again a
+// few moves later copies just the chunks those moves changed.
+void run_save_benchmark(void) {
+    static const struct { int floor_count, width, height; } runs[] = {
+        { DUNGEON_FLOOR_COUNT, GRID_COLS, GRID_ROWS }, { 128, GRID_COLS, GRID_ROWS }, { 8, 1024, 1024 }, { 2, 2048, 2048 }
+    };
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/rogue-bench.sav", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    printf("%-8s %-10s %10s %12s %10s %12s %10s %8s\n", "floors", "size", "play ms", "snapshot ms", "write ms", "resnapshot", "load ms", "file MB");
+
+    for (size_t c = 0; c < sizeof(runs) / sizeof(runs[0]); c++) {
+        GameState played = { .is_running = true, .seed = 1 };
+        played.dungeon.floor_count = runs[c].floor_count;
+        played.dungeon.width = runs[c].width;
+        played.dungeon.height = runs[c].height;
+        double ms_per_count = 1000.0 / SDL_GetPerformanceFrequency();
+        Uint64 start = SDL_GetPerformanceCounter();
+        bool is_ready = init_game(&played);
+        for (int i = 1; i < runs[c].floor_count && is_ready; i++) {
+            // Arrive on every floor in turn, as taking the stairs would
+            Floor* floor = dungeon_floor(&played.dungeon, i);
+            is_ready = floor != NULL;
+            if (is_ready) {
+                played.current_floor_index = i;
+                played.player.x = floor->stairs_up.x;
+                played.player.y = floor->stairs_up.y;
+                update_fov(&played, PLAYER_SIGHT_RADIUS);
+                dungeon_prefetch(&played.dungeon, i);
+            }
+        }
+        double play_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+
+        start = SDL_GetPerformanceCounter();
+        is_ready = is_ready && save_game(&played, path);
+        double snapshot_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+        is_ready = is_ready && finish_save(&played.saver);
+        double write_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+
+        // A few steps about the last floor, then save again
+        static const Command steps[] = { COMMAND_MOVE_RIGHT, COMMAND_MOVE_DOWN, COMMAND_MOVE_LEFT, COMMAND_MOVE_UP };
+        for (int i = 0; i < 20 && is_ready; i++) {
+            apply_command(&played, steps[i % 4]);
+        }
+        start = SDL_GetPerformanceCounter();
+        is_ready = is_ready && save_game(&played, path);
+        double resnapshot_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+        is_ready = is_ready && finish_save(&played.saver);
+        cleanup_game(&played);
+
+        GameState loaded = { .is_running = true, .load_path = path };
+        start = SDL_GetPerformanceCounter();
+        is_ready = is_ready && init_game(&loaded);
+        double load_ms = (SDL_GetPerformanceCounter() - start) * ms_per_count;
+        double file_mb = loaded.dungeon.save_bytes / (1024.0 * 1024.0);
+        cleanup_game(&loaded);
+        remove(path);
+        if (!is_ready) {
+            fprintf(stderr, "Failed to set up the save benchmark.\n");
+            return;
         }
+
+        char size_name[16];
+        snprintf(size_name, sizeof(size_name), "%dx%d", runs[c].width, runs[c].height);
+        printf("%-8d %-10s %10.2f %12.3f %10.2f %12.3f %10.2f %8.2f\n", runs[c].floor_count, size_name, play_ms, snapshot_ms, write_ms, resnapshot_ms, load_ms, file_mb);
     }
 }